@@ -1,14 +1,27 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <cstddef>
+#include <future>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 #include <avisynth.h>
 #include <fftw3.h>
 
+#include "builtin_fft.h"
 #include "complex_type.h"
+#include "sample_type.h"
 
-#ifndef STATIC_FFTW
+class worker_pool;
+
+// Also used with STATIC_FFTW - the plugin module is pinned by the background planning.
 #ifdef _WIN32
 #ifndef WIN32_LEAND_AND_MEAN
 #define WIN32_LEAN_AND_MEAN
@@ -20,10 +33,51 @@
 #else
 #include <dlfcn.h>
 #endif
-typedef fftwf_plan (*fftwf_plan_dft_2d_type)(int n0, int n1, fftwf_complex* in, fftwf_complex* out, int sign, unsigned flags);
+
+typedef fftwf_plan (*fftwf_plan_many_dft_r2c_type)(int rank, const int* n, int howmany, float* in, const int* inembed, int istride,
+    int idist, fftwf_complex* out, const int* onembed, int ostride, int odist, unsigned flags);
 typedef void (*fftwf_destroy_plan_type)(fftwf_plan);
-typedef void (*fftwf_execute_dft_type)(fftwf_plan, fftwf_complex*, fftwf_complex*);
-#endif // STATIC_FFTW
+typedef void (*fftwf_execute_dft_r2c_type)(fftwf_plan, float*, fftwf_complex*);
+typedef int (*fftwf_import_wisdom_from_filename_type)(const char* filename);
+typedef int (*fftwf_export_wisdom_to_filename_type)(const char* filename);
+typedef int (*fftwf_init_threads_type)(void);
+typedef void (*fftwf_plan_with_nthreads_type)(int nthreads);
+typedef void (*fftwf_set_timelimit_type)(double seconds);
+typedef void (*fftwf_flops_type)(const fftwf_plan p, double* add, double* mul, double* fma);
+
+// FFTW functions shared by all instances: the library is loaded once and unloaded with the last instance or plan.
+// With STATIC_FFTW these are the linked functions.
+// The optional functions (wisdom, threads) are nullptr if they aren't available.
+struct fftw_library
+{
+    fftw_library() = default;
+    fftw_library(const fftw_library&) = delete;
+    fftw_library& operator=(const fftw_library&) = delete;
+    ~fftw_library();
+
+#ifndef STATIC_FFTW
+#ifdef _WIN32
+    HINSTANCE fftw3_lib_handle = nullptr;
+    HINSTANCE fftw3_threads_lib_handle = nullptr;
+#else
+    void* fftw3_lib_handle = nullptr;
+    void* fftw3_threads_lib_handle = nullptr;
+#endif
+#endif // !STATIC_FFTW
+
+    fftwf_plan_many_dft_r2c_type fftwf_plan_many_dft_r2c = nullptr;
+    fftwf_destroy_plan_type fftwf_destroy_plan = nullptr;
+    fftwf_execute_dft_r2c_type fftwf_execute_dft_r2c = nullptr;
+    fftwf_set_timelimit_type fftwf_set_timelimit = nullptr;
+    fftwf_flops_type fftwf_flops = nullptr;
+    fftwf_import_wisdom_from_filename_type fftwf_import_wisdom_from_filename = nullptr;
+    fftwf_export_wisdom_to_filename_type fftwf_export_wisdom_to_filename = nullptr;
+    fftwf_init_threads_type fftwf_init_threads = nullptr;
+    fftwf_plan_with_nthreads_type fftwf_plan_with_nthreads = nullptr;
+
+    // fftwf_init_threads must be called only once. It's called with fftwf_plan_mutex locked, the flag is also read without it.
+    std::atomic<bool> threads_initialized{false};
+};
 
 AVS_FORCEINLINE void* aligned_malloc(size_t size, size_t align)
 {
@@ -50,6 +104,16 @@ AVS_FORCEINLINE void aligned_free(void* ptr)
 #endif
 }
 
+using fftwf_plan_ptr = std::shared_ptr<std::remove_pointer_t<fftwf_plan>>;
+
+// A plan shared by the instances with identical transforms.
+struct fftw_transform
+{
+    fftwf_plan_ptr plan;
+    // Estimated number of floating-point operations of the plan.
+    double flops;
+};
+
 template<typename T>
 struct aligned_array_deleter
 {
@@ -74,51 +138,323 @@ inline aligned_unique_ptr<T> make_unique_aligned_array_fp(size_t num_elements, s
     return aligned_unique_ptr<T>(ptr);
 }
 
+// Scratch buffers of a single GetFrame call.
+struct fft_workspace
+{
+    aligned_unique_ptr<float> fft_in;
+    // Empty for the in-place transform.
+    aligned_unique_ptr<complex_float> fft_out;
+    aligned_unique_ptr<float> abs_array;
+    // Used only by the built-in FFT.
+    aligned_unique_ptr<float> builtin_work;
+    // Number of the allocated workspaces of the instance, decremented when the workspace is freed.
+    std::atomic<int>* live_count = nullptr;
+
+    ~fft_workspace()
+    {
+        if (live_count)
+            live_count->fetch_sub(1, std::memory_order_relaxed);
+    }
+};
+
+// Lock-free pool of workspaces shared by the threads that call GetFrame of one instance.
+// The pool holds up to capacity idle workspaces; a workspace released to a full pool is freed.
+class fft_workspace_pool
+{
+public:
+    static constexpr int capacity = 64;
+
+    fft_workspace_pool() = default;
+    fft_workspace_pool(const fft_workspace_pool&) = delete;
+    fft_workspace_pool& operator=(const fft_workspace_pool&) = delete;
+
+    ~fft_workspace_pool()
+    {
+        for (auto& slot : slots)
+            delete slot.load(std::memory_order_relaxed);
+    }
+
+    // Returns nullptr if there is no idle workspace.
+    std::unique_ptr<fft_workspace> acquire() noexcept
+    {
+        for (auto& slot : slots)
+        {
+            if (slot.load(std::memory_order_relaxed))
+            {
+                if (fft_workspace* workspace = slot.exchange(nullptr, std::memory_order_acquire))
+                    return std::unique_ptr<fft_workspace>(workspace);
+            }
+        }
+
+        return nullptr;
+    }
+
+    void release(std::unique_ptr<fft_workspace> workspace) noexcept
+    {
+        for (auto& slot : slots)
+        {
+            fft_workspace* expected = nullptr;
+
+            if (!slot.load(std::memory_order_relaxed) &&
+                slot.compare_exchange_strong(expected, workspace.get(), std::memory_order_release, std::memory_order_relaxed))
+            {
+                workspace.release();
+                return;
+            }
+        }
+    }
+
+private:
+    std::array<std::atomic<fft_workspace*>, capacity> slots{};
+};
+
+// Bounded LRU cache of the output frames, keyed by the frame number.
+class frame_cache
+{
+public:
+    // In bytes, 0 - disabled.
+    void set_capacity(size_t bytes) noexcept
+    {
+        capacity = bytes;
+    }
+
+    size_t get_capacity() const noexcept
+    {
+        return capacity;
+    }
+
+    // Returns an empty frame if n isn't cached.
+    PVideoFrame lookup(int n)
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = index.find(n);
+
+        if (it == index.end())
+            return PVideoFrame();
+
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->frame;
+    }
+
+    // frame_size is the size of the frame data in bytes. The least recently used frames are evicted until the frame fits.
+    void insert(int n, const PVideoFrame& frame, size_t frame_size)
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+
+        // Another thread rendered the same frame.
+        if (auto it = index.find(n); it != index.end())
+        {
+            lru.splice(lru.begin(), lru, it->second);
+            return;
+        }
+
+        if (frame_size > capacity)
+            return;
+
+        while (size + frame_size > capacity)
+        {
+            size -= lru.back().size;
+            index.erase(lru.back().n);
+            lru.pop_back();
+        }
+
+        lru.emplace_front(entry{n, frame, frame_size});
+        index.emplace(n, lru.begin());
+        size += frame_size;
+    }
+
+private:
+    struct entry
+    {
+        int n;
+        PVideoFrame frame;
+        size_t size;
+    };
+
+    size_t capacity = 0;
+    // Sum of the sizes of the cached frames.
+    size_t size = 0;
+    std::mutex mutex;
+    // The most recently used frame is first.
+    std::list<entry> lru;
+    std::unordered_map<int, std::list<entry>::iterator> index;
+};
+
 class FFTSpectrum : public GenericVideoFilter
 {
 public:
-    FFTSpectrum(PClip _child, bool grid, int opt, IScriptEnvironment* env);
+    FFTSpectrum(PClip _child, bool grid, int opt, const char* wisdom, int threads, int planner, double plan_timelimit, int engine,
+        bool inplace, int prefetch, int cache, bool dedup, bool async_plan, const AVSValue& planes, int roi_left, int roi_top,
+        int roi_width, int roi_height, bool fields, IScriptEnvironment* env);
     PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env) override;
 
     int __stdcall SetCacheHints(int cachehints, int frame_range) override
     {
-        return cachehints == CACHE_GET_MTMODE ? MT_MULTI_INSTANCE : 0;
+        return cachehints == CACHE_GET_MTMODE ? MT_NICE_FILTER : 0;
     }
 
     ~FFTSpectrum();
 
 private:
+    // Planes with the same dimensions (U and V), transformed by a single batched FFTW plan.
+    struct plane_group
+    {
+        // Indices of the planes (0 - Y/G, 1 - U/B, 2 - V/R).
+        std::array<int, 3> planes;
+        int count;
+        // Number of transforms: count * num_fields.
+        int batch;
+        int width;
+        // Height of a field in the fields mode.
+        int height;
+        // Position of the region in the source planes (bytes, rows).
+        int src_left;
+        int src_top;
+        // Both dimensions are even - the input is multiplied by (-1)^(x+y), which centers the spectrum (fftshift).
+        bool centered;
+        // Distance (in floats) between the rows of fft_in.
+        int fft_in_stride;
+        // Distance (in floats) between the transforms in fft_in.
+        size_t plane_size;
+        // Number of complex elements of a spectrum, the distance between the transforms in fft_out.
+        size_t spectrum_size;
+        // Offsets (in elements) of the first transform in fft_in and fft_out.
+        size_t in_offset;
+        size_t out_offset;
+
+        // Real-to-complex transform: only the non-redundant half (width / 2 + 1 columns) of the Hermitian symmetric spectrum is stored.
+        // Replaced when the measured plan is ready (async_plan), empty for the built-in FFT. Guarded by transform_mutex.
+        std::shared_ptr<const fftw_transform> transform;
+        // Used when FFTW isn't (transform is empty).
+        std::unique_ptr<builtin_fft_plan> builtin_plan;
+    };
+
+    std::unique_ptr<fft_workspace> create_workspace(IScriptEnvironment* env);
+    std::shared_ptr<const fftw_transform> load_transform(const plane_group& group) const;
+    void store_transform(plane_group& group, std::shared_ptr<const fftw_transform> transform);
+    // Requires AviSynth+ 3.6+.
+    void set_frame_properties(PVideoFrame& dst, IScriptEnvironment* env);
+    // dedup: returns the output of frame n - 1 if its source has the same hash. Otherwise the caller renders frame n and sets it
+    // through rendered.
+    std::shared_future<PVideoFrame> match_previous_frame(int n, uint64_t hash, std::promise<PVideoFrame>& rendered);
+
     bool m_grid;
 
-    aligned_unique_ptr<complex_float> fft_in;
-    aligned_unique_ptr<complex_float> fft_out;
-    fftwf_plan p;
-    aligned_unique_ptr<float> abs_array;
+    // The transform overwrites fft_in (fft_out isn't allocated).
+    bool m_inplace;
+    // Multiplier of the source samples (to the 8-bit range).
+    float sample_scale;
+
+    // Y, U, V or G, B, R. The planes that aren't processed are blank in the output.
+    std::array<bool, 3> process_planes;
+    // The AviSynth plane ids of the indices of process_planes.
+    const int* plane_ids;
+    // 2 - the fields of every plane are transformed separately (the top field is the first) and stacked in the output.
+    int num_fields;
+    std::array<plane_group, 3> groups;
+    int num_groups;
+    mutable std::mutex transform_mutex;
+    // The transforms replaced by the measured ones (async_plan), released with the instance.
+    std::vector<std::shared_ptr<const fftw_transform>> retired_transforms;
+
+    // Shared with the background planning (async_plan), which can outlive the instance.
+    struct plan_upgrade_state
+    {
+        std::mutex mutex;
+        // nullptr after the instance is destroyed.
+        FFTSpectrum* owner;
+    };
+
+    std::shared_ptr<plan_upgrade_state> plan_upgrade;
+
+    frame_cache output_cache;
+
+    // The source hash is compared with the one of frame n - 1, which is returned again if they match. The recent frames are kept by
+    // number - in MT mode they are processed out of order. The hash is stored before the frame is rendered, the frames that
+    // match it wait for the output.
+    struct dedup_entry
+    {
+        uint64_t hash;
+        std::shared_future<PVideoFrame> frame;
+    };
+
+    static constexpr size_t dedup_history_size = 16;
+
+    bool m_dedup;
+    std::mutex dedup_mutex;
+    std::map<int, dedup_entry> dedup_history;
+
+    // Number of row bands of the fill, magnitude and render stages.
+    int m_threads;
+    std::shared_ptr<worker_pool> stage_workers;
+
+    int m_alignment;
+    // The workspaces that are allocated (idle in the pool or used by GetFrame). Declared before the pool, which frees them.
+    std::atomic<int> live_workspaces;
+    fft_workspace_pool workspaces;
+    // Number of elements of the workspace buffers. All groups are in the same fft_in/fft_out, abs_array holds one plane.
+    size_t fft_in_size;
+    size_t fft_out_size;
+    size_t abs_size;
+    size_t builtin_work_size;
+    // Size of a workspace in bytes.
+    size_t workspace_size;
 
     bool has_at_least_v8;
 
-#ifndef STATIC_FFTW
-#ifdef _WIN32
-    HINSTANCE fftw3_lib_handle;
-#else
-    void* fftw3_lib_handle;
-#endif
-    fftwf_plan_dft_2d_type fftwf_plan_dft_2d;
-    fftwf_destroy_plan_type fftwf_destroy_plan;
-    fftwf_execute_dft_type fftwf_execute_dft;
-#endif // !STATIC_FFTW
+    // Empty for the built-in FFT.
+    std::shared_ptr<fftw_library> fftw_lib;
 
-    void (*fill_fft_input_array)(
-        complex_float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int stride) noexcept;
-    void (*calculate_absolute_values)(float* __restrict dstp, const complex_float* __restrict srcp, int length) noexcept;
+    // Instantiated for the sample type of the clip, stride is in bytes. Returns the content hash of the source rows if hashed, otherwise 0.
+    uint64_t (*fill_fft_input_array)(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int stride,
+        int dst_stride, float scale, bool centered, bool hashed) noexcept;
+    float (*calculate_absolute_values)(
+        float* __restrict dstp, const complex_float* __restrict srcp, int length, int excluded_index) noexcept;
+    void (*builtin_fft_r2c_2d)(
+        const builtin_fft_plan& plan, const float* srcp, int src_stride, complex_float* dstp, float* __restrict work) noexcept;
+    void (*draw_fft_spectrum)(
+        uint8_t* __restrict dstp, const float* __restrict srcp, int width, int height, int stride, float max_sq, bool centered,
+        int y_begin, int y_end) noexcept;
 };
 
-void fill_fft_input_array_c(complex_float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int src_stride) noexcept;
-void calculate_absolute_values_c(float* __restrict dstp, const complex_float* __restrict srcp, int length) noexcept;
-void fill_fft_input_array_sse2(complex_float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int stride) noexcept;
-void calculate_absolute_values_sse2(float* __restrict dstp, const complex_float* __restrict srcp, int length) noexcept;
-void fill_fft_input_array_avx2(complex_float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int stride) noexcept;
-void calculate_absolute_values_avx2(float* __restrict dstp, const complex_float* __restrict srcp, int length) noexcept;
-void fill_fft_input_array_avx512(
-    complex_float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int stride) noexcept;
-void calculate_absolute_values_avx512(float* __restrict dstp, const complex_float* __restrict srcp, int length) noexcept;
+template<typename T>
+uint64_t fill_fft_input_array_c(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int src_stride,
+    int dst_stride, float scale, bool centered, bool hashed) noexcept;
+float calculate_absolute_values_c(
+    float* __restrict dstp, const complex_float* __restrict srcp, int length, int excluded_index) noexcept;
+template<typename T>
+uint64_t fill_fft_input_array_sse2(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int stride,
+    int dst_stride, float scale, bool centered, bool hashed) noexcept;
+float calculate_absolute_values_sse2(
+    float* __restrict dstp, const complex_float* __restrict srcp, int length, int excluded_index) noexcept;
+template<typename T>
+uint64_t fill_fft_input_array_avx2(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int stride,
+    int dst_stride, float scale, bool centered, bool hashed) noexcept;
+float calculate_absolute_values_avx2(
+    float* __restrict dstp, const complex_float* __restrict srcp, int length, int excluded_index) noexcept;
+template<typename T>
+uint64_t fill_fft_input_array_avx512(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int stride,
+    int dst_stride, float scale, bool centered, bool hashed) noexcept;
+float calculate_absolute_values_avx512(
+    float* __restrict dstp, const complex_float* __restrict srcp, int length, int excluded_index) noexcept;
+void builtin_fft_r2c_2d_c(
+    const builtin_fft_plan& plan, const float* srcp, int src_stride, complex_float* dstp, float* __restrict work) noexcept;
+void builtin_fft_r2c_2d_sse2(
+    const builtin_fft_plan& plan, const float* srcp, int src_stride, complex_float* dstp, float* __restrict work) noexcept;
+void builtin_fft_r2c_2d_avx2(
+    const builtin_fft_plan& plan, const float* srcp, int src_stride, complex_float* dstp, float* __restrict work) noexcept;
+void builtin_fft_r2c_2d_avx512(
+    const builtin_fft_plan& plan, const float* srcp, int src_stride, complex_float* dstp, float* __restrict work) noexcept;
+void draw_fft_spectrum_c(
+    uint8_t* __restrict dstp, const float* __restrict srcp, int width, int height, int stride, float max_sq, bool centered,
+    int y_begin, int y_end) noexcept;
+void draw_fft_spectrum_sse2(
+    uint8_t* __restrict dstp, const float* __restrict srcp, int width, int height, int stride, float max_sq, bool centered,
+    int y_begin, int y_end) noexcept;
+void draw_fft_spectrum_avx2(
+    uint8_t* __restrict dstp, const float* __restrict srcp, int width, int height, int stride, float max_sq, bool centered,
+    int y_begin, int y_end) noexcept;
+void draw_fft_spectrum_avx512(
+    uint8_t* __restrict dstp, const float* __restrict srcp, int width, int height, int stride, float max_sq, bool centered,
+    int y_begin, int y_end) noexcept;
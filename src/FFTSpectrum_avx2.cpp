@@ -3,12 +3,37 @@
 #include "vcl_log_constants.h"
 #include "vcl_utils.h"
 
-void fill_fft_input_array_avx2(complex_float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int stride) noexcept
+template<typename T>
+uint64_t fill_fft_input_array_avx2(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int stride,
+    int dst_stride, float scale, bool centered, bool hashed) noexcept
 {
-    vcl_utils::fill_fft_input_array_templated<Vec8f, complex_float>(dstp, srcp, width, height, stride);
+    return vcl_utils::fill_fft_input_array_templated<Vec8f, T>(dstp, srcp, width, height, stride, dst_stride, scale, centered, hashed);
 }
 
-void calculate_absolute_values_avx2(float* __restrict dstp, const complex_float* __restrict srcp, int length) noexcept
+template uint64_t fill_fft_input_array_avx2<uint8_t>(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height,
+    int stride, int dst_stride, float scale, bool centered, bool hashed) noexcept;
+template uint64_t fill_fft_input_array_avx2<uint16_t>(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height,
+    int stride, int dst_stride, float scale, bool centered, bool hashed) noexcept;
+template uint64_t fill_fft_input_array_avx2<float>(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height,
+    int stride, int dst_stride, float scale, bool centered, bool hashed) noexcept;
+template uint64_t fill_fft_input_array_avx2<yuy2_luma>(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height,
+    int stride, int dst_stride, float scale, bool centered, bool hashed) noexcept;
+
+float calculate_absolute_values_avx2(
+    float* __restrict dstp, const complex_float* __restrict srcp, int length, int excluded_index) noexcept
+{
+    return vcl_utils::calculate_absolute_values_templated<Vec8f, true>(dstp, srcp, length, excluded_index);
+}
+
+void builtin_fft_r2c_2d_avx2(
+    const builtin_fft_plan& plan, const float* srcp, int src_stride, complex_float* dstp, float* __restrict work) noexcept
+{
+    builtin_fft_r2c_2d_templated<Vec8f>(plan, srcp, src_stride, dstp, work);
+}
+
+void draw_fft_spectrum_avx2(
+    uint8_t* __restrict dstp, const float* __restrict srcp, int width, int height, int stride, float max_sq, bool centered,
+    int y_begin, int y_end) noexcept
 {
-    vcl_utils::calculate_absolute_values_templated<Vec8f, true>(dstp, srcp, length);
+    vcl_utils::draw_fft_spectrum_templated<Vec8f>(dstp, srcp, width, height, stride, max_sq, centered, y_begin, y_end);
 }
@@ -2,6 +2,8 @@
 #include <cmath>
 
 #include "FFTSpectrum.h"
+#include "builtin_fft.h"
+#include "content_hash.h"
 
 constexpr float ONE = 1.0f;
 constexpr float P0_5 = 0.5f;
@@ -81,38 +83,114 @@ AVS_FORCEINLINE float log_ps_c(float x_input)
     return x;
 }
 
-void fill_fft_input_array_c(complex_float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int src_stride) noexcept
+template<typename T>
+uint64_t fill_fft_input_array_c(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int src_stride,
+    int dst_stride, float scale, bool centered, bool hashed) noexcept
 {
+    uint64_t hash = content_hash::seed;
+
     for (int y = 0; y < height; ++y)
     {
-        const uint8_t* p_src = srcp + static_cast<ptrdiff_t>(y) * src_stride;
-        complex_float* p_dst = dstp + static_cast<ptrdiff_t>(y) * width;
-        for (int x = 0; x < width; ++x)
+        const T* p_src = reinterpret_cast<const T*>(srcp + static_cast<ptrdiff_t>(y) * src_stride);
+        float* p_dst = dstp + static_cast<ptrdiff_t>(y) * dst_stride;
+
+        if (hashed)
+        {
+            for (int x = 0; x < width; ++x)
+                hash = content_hash::mix64(hash, content_hash::sample_bits(p_src[x]));
+        }
+
+        if (centered)
         {
-            p_dst[x].re = static_cast<float>(p_src[x]);
-            p_dst[x].im = 0.0f;
+            for (int x = 0; x < width; ++x)
+                p_dst[x] = sample_value(p_src[x]) * (((x + y) & 1) ? -scale : scale);
+        }
+        else
+        {
+            for (int x = 0; x < width; ++x)
+                p_dst[x] = sample_value(p_src[x]) * scale;
         }
     }
+
+    return (hashed) ? hash : 0;
 }
 
-void calculate_absolute_values_c(float* __restrict dstp, const complex_float* __restrict srcp, int length) noexcept
+template uint64_t fill_fft_input_array_c<uint8_t>(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height,
+    int src_stride, int dst_stride, float scale, bool centered, bool hashed) noexcept;
+template uint64_t fill_fft_input_array_c<uint16_t>(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height,
+    int src_stride, int dst_stride, float scale, bool centered, bool hashed) noexcept;
+template uint64_t fill_fft_input_array_c<float>(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height,
+    int src_stride, int dst_stride, float scale, bool centered, bool hashed) noexcept;
+template uint64_t fill_fft_input_array_c<yuy2_luma>(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height,
+    int src_stride, int dst_stride, float scale, bool centered, bool hashed) noexcept;
+
+float calculate_absolute_values_c(
+    float* __restrict dstp, const complex_float* __restrict srcp, int length, int excluded_index) noexcept
 {
+    float max_value = 0.f;
+
     for (int i = 0; i < length; ++i)
     {
         const float re = srcp[i].re;
         const float im = srcp[i].im;
 
-        const float mag_sq = re * re + im * im;
-        const float mag = sqrtf(mag_sq);
+        dstp[i] = re * re + im * im;
+
+        if (i != excluded_index && dstp[i] > max_value)
+            max_value = dstp[i];
+    }
+
+    return max_value;
+}
 
-        const float val_to_log = mag + ONE;
+void builtin_fft_r2c_2d_c(
+    const builtin_fft_plan& plan, const float* srcp, int src_stride, complex_float* dstp, float* __restrict work) noexcept
+{
+    builtin_fft_r2c_2d_templated<float>(plan, srcp, src_stride, dstp, work);
+}
 
-        dstp[i] = log_ps_c(val_to_log);
-        // Alternatively, for standard library log:
-        // if (val_to_log <= 0.0f) { // logf domain check
-        //     dstp_abs[i] = std::numeric_limits<float>::quiet_NaN();
-        // } else {
-        //     dstp_abs[i] = logf(val_to_log); // from <cmath>
-        // }
+// srcp holds the squared magnitudes of the non-redundant half (width / 2 + 1 columns) of the spectrum of a real input.
+// The other half is reconstructed through the Hermitian symmetry |F(u, v)| = |F(-u, -v)|.
+// centered: the spectrum is already centered by the modulated input, otherwise the quadrants are swapped here.
+// max_sq: the maximum returned by calculate_absolute_values.
+// Only the rows [y_begin, y_end) of dstp are drawn.
+// The displayed value is log(|F| + 1); values below half of the maximum are zeroed, so the logarithm is evaluated only
+// above the equivalent bound on the squared magnitude.
+void draw_fft_spectrum_c(
+    uint8_t* __restrict dstp, const float* __restrict srcp, int width, int height, int stride, float max_sq, bool centered,
+    int y_begin, int y_end) noexcept
+{
+    const int spectrum_width = width / 2 + 1;
+    const float max_value = log_ps_c(sqrtf(max_sq) + ONE);
+    const float threshold = max_value / 2;
+    const float scale = (max_value > 0.f) ? 255.f / max_value : 0.f;
+    // log(m + 1) > log(max + 1) / 2 <=> m > sqrt(max + 1) - 1, lowered slightly so log_ps_c decides near the threshold.
+    const float threshold_m = sqrtf(sqrtf(max_sq) + ONE) - ONE;
+    const float threshold_sq = threshold_m * threshold_m * 0.99f;
+
+    for (int y = y_begin; y < y_end; ++y)
+    {
+        const int src_y = centered ? y : (y + height - height / 2) % height;
+        const float* src_row = srcp + src_y * spectrum_width;
+        const float* src_row_mirrored = srcp + ((height - src_y) % height) * spectrum_width;
+        uint8_t* dst_row = dstp + static_cast<ptrdiff_t>(y) * stride;
+
+        for (int x = 0; x < width; ++x)
+        {
+            const int src_x = centered ? x : (x + width - width / 2) % width;
+            const float val_sq = (src_x < spectrum_width) ? src_row[src_x] : src_row_mirrored[width - src_x];
+            if (val_sq <= threshold_sq)
+            {
+                dst_row[x] = 0;
+                continue;
+            }
+
+            const float val = log_ps_c(sqrtf(val_sq) + ONE);
+            float buf = val > threshold ? val * scale : 0;
+            if (buf > 255)
+                buf = 255;
+
+            dst_row[x] = static_cast<uint8_t>(lrintf(buf));
+        }
     }
 }
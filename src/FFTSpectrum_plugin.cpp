@@ -1,10 +1,300 @@
 #include <cmath>
+#include <compare>
 #include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
 #include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "FFTSpectrum.h"
+#include "content_hash.h"
+#include "worker_pool.h"
 
+enum class fftw_transform_kind
+{
+    r2c_2d
+};
+
+struct fftw_plan_key
+{
+    fftw_transform_kind kind;
+    int height;
+    int width;
+    // Number of planes transformed by the plan.
+    int batch;
+    unsigned flags;
+    int alignment;
+    int threads;
+    bool inplace;
+
+    auto operator<=>(const fftw_plan_key&) const = default;
+};
+
+// The FFTW functions other than execute aren't thread-safe - the planner, fftwf_destroy_plan, fftwf_flops etc. are called with
+// fftwf_plan_mutex locked, through fftw_planner_lock.
 static std::mutex fftwf_plan_mutex;
+static std::mutex fftwf_deferred_plans_mutex;
+// The plans released while the planner was busy (e.g. measuring in the background). They are destroyed by the thread that holds
+// the planner before it unlocks it, so releasing a plan never waits for a measurement.
+static std::vector<std::pair<fftwf_plan, std::shared_ptr<fftw_library>>> fftwf_deferred_plans;
+
+class fftw_planner_lock
+{
+public:
+    fftw_planner_lock() : lock(fftwf_plan_mutex)
+    {
+    }
+
+    explicit fftw_planner_lock(std::try_to_lock_t) : lock(fftwf_plan_mutex, std::try_to_lock)
+    {
+    }
+
+    fftw_planner_lock(const fftw_planner_lock&) = delete;
+    fftw_planner_lock& operator=(const fftw_planner_lock&) = delete;
+
+    ~fftw_planner_lock()
+    {
+        if (lock.owns_lock())
+            unlock();
+    }
+
+    bool owns_lock() const noexcept
+    {
+        return lock.owns_lock();
+    }
+
+    void unlock()
+    {
+        // A plan can be deferred after the last check - it's destroyed here if the planner is free again, otherwise by its new owner.
+        do
+        {
+            destroy_deferred_plans();
+            lock.unlock();
+        } while (has_deferred_plans() && lock.try_lock());
+    }
+
+    static void destroy_plan(fftwf_plan plan, std::shared_ptr<fftw_library> lib)
+    {
+        {
+            const std::lock_guard<std::mutex> deferred_lock(fftwf_deferred_plans_mutex);
+            fftwf_deferred_plans.emplace_back(plan, std::move(lib));
+        }
+
+        fftw_planner_lock planner(std::try_to_lock);
+    }
+
+private:
+    static bool has_deferred_plans()
+    {
+        const std::lock_guard<std::mutex> deferred_lock(fftwf_deferred_plans_mutex);
+        return !fftwf_deferred_plans.empty();
+    }
+
+    static void destroy_deferred_plans()
+    {
+        std::vector<std::pair<fftwf_plan, std::shared_ptr<fftw_library>>> plans;
+
+        {
+            const std::lock_guard<std::mutex> deferred_lock(fftwf_deferred_plans_mutex);
+            plans.swap(fftwf_deferred_plans);
+        }
+
+        // The library can be unloaded with the last plan.
+        for (auto& [plan, lib] : plans)
+            lib->fftwf_destroy_plan(plan);
+    }
+
+    std::unique_lock<std::mutex> lock;
+};
+
+// Process-wide registry of the plans. The new-array execute functions are used, so a plan isn't bound to the buffers it was
+// created with and identical transforms (several clips of the same size) share one plan.
+// The plan is destroyed with the last reference. The lookups don't wait for the planner.
+static std::mutex fftwf_plan_registry_mutex;
+static std::map<fftw_plan_key, std::weak_ptr<const fftw_transform>> fftwf_plan_registry;
+
+static std::shared_ptr<const fftw_transform> find_shared_plan(const fftw_plan_key& key)
+{
+    const std::lock_guard<std::mutex> lock(fftwf_plan_registry_mutex);
+
+    if (const auto it = fftwf_plan_registry.find(key); it != fftwf_plan_registry.end())
+        return it->second.lock();
+
+    return nullptr;
+}
+
+// Called with the planner locked.
+template<typename F>
+static std::shared_ptr<const fftw_transform> acquire_shared_plan_locked(
+    const fftw_plan_key& key, F&& create_plan, const std::shared_ptr<fftw_library>& lib)
+{
+    // Created by another thread while this one waited for the planner.
+    if (std::shared_ptr<const fftw_transform> transform = find_shared_plan(key))
+        return transform;
+
+    const fftwf_plan new_plan = create_plan();
+
+    if (!new_plan)
+        return nullptr;
+
+    // The plan keeps the library loaded.
+    fftwf_plan_ptr plan(new_plan, [key, lib](fftwf_plan p) {
+        fftw_planner_lock::destroy_plan(p, lib);
+
+        const std::lock_guard<std::mutex> lock(fftwf_plan_registry_mutex);
+
+        // The entry could be already replaced by a new plan for the same key.
+        if (const auto it = fftwf_plan_registry.find(key); it != fftwf_plan_registry.end() && it->second.expired())
+            fftwf_plan_registry.erase(it);
+    });
+
+    double add;
+    double mul;
+    double fma;
+    lib->fftwf_flops(new_plan, &add, &mul, &fma);
+
+    auto transform = std::make_shared<const fftw_transform>(fftw_transform{std::move(plan), add + mul + 2.0 * fma});
+
+    const std::lock_guard<std::mutex> lock(fftwf_plan_registry_mutex);
+    fftwf_plan_registry[key] = transform;
+
+    return transform;
+}
+
+template<typename F>
+static std::shared_ptr<const fftw_transform> acquire_shared_plan(
+    const fftw_plan_key& key, F&& create_plan, const std::shared_ptr<fftw_library>& lib)
+{
+    if (std::shared_ptr<const fftw_transform> transform = find_shared_plan(key))
+        return transform;
+
+    const fftw_planner_lock planner;
+
+    return acquire_shared_plan_locked(key, std::forward<F>(create_plan), lib);
+}
+
+// The thread of the background planning (async_plan), shared by the instances - the planner is process-wide anyway.
+// It's defined after the planner and the registry, so it's stopped and joined before they are destroyed. A running measurement
+// can't be interrupted, the tasks check stop_requested() between the measurements.
+class background_planner
+{
+public:
+    background_planner() = default;
+
+    background_planner(const background_planner&) = delete;
+    background_planner& operator=(const background_planner&) = delete;
+
+    ~background_planner()
+    {
+        std::deque<std::function<void()>> pending;
+
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            stopping.store(true, std::memory_order_relaxed);
+            pending.swap(tasks);
+        }
+
+        if (thread.joinable())
+            thread.join();
+    }
+
+    void run(std::function<void()> task)
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+
+        tasks.push_back(std::move(task));
+
+        if (!running)
+        {
+            // The previous thread has returned (or is returning) after its last task.
+            if (thread.joinable())
+                thread.join();
+
+            running = true;
+            thread = std::thread([this]() { thread_loop(); });
+        }
+    }
+
+    bool stop_requested() const noexcept
+    {
+        return stopping.load(std::memory_order_relaxed);
+    }
+
+private:
+    // The thread exits when there's nothing to plan.
+    void thread_loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (!stop_requested() && !tasks.empty())
+        {
+            std::function<void()> task = std::move(tasks.front());
+            tasks.pop_front();
+
+            lock.unlock();
+            task();
+            // The captures (the library, the plans) are released without the lock.
+            task = nullptr;
+            lock.lock();
+        }
+
+        running = false;
+    }
+
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+    // Guarded by mutex.
+    bool running = false;
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+};
+
+static background_planner fftwf_background_planner;
+
+static std::mutex worker_pool_mutex;
+// The workers are shared by all instances and stopped with the last one (not at the unloading of the library).
+static std::weak_ptr<worker_pool> shared_worker_pool;
+
+static std::shared_ptr<worker_pool> acquire_worker_pool()
+{
+    const std::lock_guard<std::mutex> lock(worker_pool_mutex);
+
+    std::shared_ptr<worker_pool> pool = shared_worker_pool.lock();
+
+    if (!pool)
+    {
+        // The thread that calls GetFrame executes tasks too.
+        pool = std::make_shared<worker_pool>(std::max(static_cast<int>(std::thread::hardware_concurrency()), 2) - 1);
+        shared_worker_pool = pool;
+    }
+
+    return pool;
+}
+
+// Splits [0, length) into at most bands ranges that start at multiples of granularity and calls f(begin, end) for every range,
+// on the workers of pool if it isn't nullptr.
+template<typename F>
+static void run_in_bands(worker_pool* pool, int bands, int length, int granularity, F&& f)
+{
+    int band_size = (length + bands - 1) / bands;
+    band_size = (band_size + granularity - 1) / granularity * granularity;
+    const int count = (length + band_size - 1) / band_size;
+
+    auto task = [&](int i) { f(i * band_size, std::min((i + 1) * band_size, length)); };
+
+    if (pool)
+        pool->run(count, task);
+    else
+    {
+        for (int i = 0; i < count; ++i)
+            task(i);
+    }
+}
 
 #ifndef STATIC_FFTW
 template<typename T>
@@ -24,79 +314,80 @@ T load_symbol_portable(
     return func_ptr;
 #endif
 }
-#endif
 
-static void draw_fft_spectrum(uint8_t* dstp, float* srcp, int width, int height, int stride)
+static void close_library_portable(
+#ifdef _WIN32
+    HINSTANCE lib_handle
+#else
+    void* lib_handle
+#endif
+)
 {
-    float max = 0.f;
+#ifdef _WIN32
+    FreeLibrary(lib_handle);
+#else
+    dlclose(lib_handle);
+#endif
+}
+#endif
 
-    memset(dstp, 0, static_cast<int64_t>(stride) * height);
+// The background planning runs the code of the plugin after the instance is destroyed, so the plugin stays loaded until the process
+// exits once it's started. The planning thread is joined with the statics at the exit.
+static void pin_plugin_module()
+{
+    static std::once_flag pinned;
 
-    for (int i = 1; i < height * width; ++i)
-    {
-        if (srcp[i] > max)
-            max = srcp[i];
-    }
+    std::call_once(pinned, []() {
+#ifdef _WIN32
+        HMODULE module;
+        GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+            reinterpret_cast<LPCWSTR>(&pin_plugin_module), &module);
+#else
+        Dl_info info;
 
-    for (int y = 0; y < height; ++y)
-    {
-        for (int x = 0; x < width; ++x)
-        {
-            float buf = srcp[x + y * width] > max / 2 ? srcp[x + y * width] : 0;
-            buf = 255 * buf / max;
-            if (buf < 0)
-                buf = 0;
-            if (buf > 255)
-                buf = 255;
-
-            if (y < height / 2)
-            {
-                if (x < width / 2)
-                    dstp[x + (width / 2) + stride * (y + height / 2)] = static_cast<uint8_t>(lrintf(buf));
-                else
-                    dstp[x - (width / 2) + stride * (y + height / 2)] = static_cast<uint8_t>(lrintf(buf));
-            }
-            else
-            {
-                if (x < width / 2)
-                    dstp[x + (width / 2) + stride * (y - height / 2)] = static_cast<uint8_t>(lrintf(buf));
-                else
-                    dstp[x - (width / 2) + stride * (y - height / 2)] = static_cast<uint8_t>(lrintf(buf));
-            }
-        }
-    }
+        if (dladdr(reinterpret_cast<void*>(&pin_plugin_module), &info) && info.dli_fname)
+            dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD | RTLD_NODELETE);
+#endif
+    });
 }
 
-static void draw_grid(uint8_t* buf, int width, int height, int stride)
+fftw_library::~fftw_library()
 {
-    for (int x = (width / 2) % 100; x < width; x += 100)
-    {
-        for (int y = 0; y < height; ++y)
-            buf[x + y * stride] = 255;
-    }
+#ifndef STATIC_FFTW
+    if (fftw3_threads_lib_handle)
+        close_library_portable(fftw3_threads_lib_handle);
 
-    for (int y = (height / 2) % 100; y < height; y += 100)
-    {
-        for (int x = 0; x < width; ++x)
-            buf[x + y * stride] = 255;
-    }
+    if (fftw3_lib_handle)
+        close_library_portable(fftw3_lib_handle);
+#endif
 }
 
-FFTSpectrum::FFTSpectrum(PClip _child, bool grid, int opt, IScriptEnvironment* env)
-    : GenericVideoFilter(_child),
-      m_grid(grid)
-#ifndef STATIC_FFTW
-      ,
-      fftw3_lib_handle(nullptr),
-      fftwf_plan_dft_2d(nullptr),
-      fftwf_destroy_plan(nullptr),
-      fftwf_execute_dft(nullptr)
-#endif
+static std::mutex fftw_library_mutex;
+static std::weak_ptr<fftw_library> shared_fftw_library;
+
+// Returns nullptr and sets error if FFTW can't be loaded. A failed load is retried by the next instance.
+static std::shared_ptr<fftw_library> acquire_fftw_library(std::string& error)
 {
-    if (vi.BitsPerComponent() != 8 || vi.IsRGB() || !vi.IsPlanar())
-        env->ThrowError("FFTSpectrum: clip must be in YUV 8-bit planar format.");
+    const std::lock_guard<std::mutex> lock(fftw_library_mutex);
 
-#ifndef STATIC_FFTW
+    if (std::shared_ptr<fftw_library> lib = shared_fftw_library.lock())
+        return lib;
+
+    auto lib = std::make_shared<fftw_library>();
+
+#ifdef STATIC_FFTW
+    lib->fftwf_plan_many_dft_r2c = ::fftwf_plan_many_dft_r2c;
+    lib->fftwf_destroy_plan = ::fftwf_destroy_plan;
+    lib->fftwf_execute_dft_r2c = ::fftwf_execute_dft_r2c;
+    lib->fftwf_set_timelimit = ::fftwf_set_timelimit;
+    lib->fftwf_flops = ::fftwf_flops;
+    lib->fftwf_import_wisdom_from_filename = ::fftwf_import_wisdom_from_filename;
+    lib->fftwf_export_wisdom_to_filename = ::fftwf_export_wisdom_to_filename;
+#ifdef STATIC_FFTW_THREADS
+    lib->fftwf_init_threads = ::fftwf_init_threads;
+    lib->fftwf_plan_with_nthreads = ::fftwf_plan_with_nthreads;
+#endif
+#else
 #ifdef _WIN32
     const char* fftw_lib_names[] = {"libfftw3f-3.dll", "fftw3.dll"};
 #elif defined(__APPLE__)
@@ -108,15 +399,15 @@ FFTSpectrum::FFTSpectrum(PClip _child, bool grid, int opt, IScriptEnvironment* e
     for (const char* name : fftw_lib_names)
     {
 #ifdef _WIN32
-        fftw3_lib_handle = LoadLibraryA(name);
+        lib->fftw3_lib_handle = LoadLibraryA(name);
 #else
-        fftw3_lib_handle = dlopen(name, RTLD_LAZY | RTLD_LOCAL);
+        lib->fftw3_lib_handle = dlopen(name, RTLD_LAZY | RTLD_LOCAL);
 #endif
-        if (fftw3_lib_handle)
+        if (lib->fftw3_lib_handle)
             break;
     }
 
-    if (!fftw3_lib_handle)
+    if (!lib->fftw3_lib_handle)
     {
         std::string attempted_names;
         for (size_t i = 0; i < (sizeof(fftw_lib_names) / sizeof(fftw_lib_names[0])); ++i)
@@ -127,33 +418,229 @@ FFTSpectrum::FFTSpectrum(PClip _child, bool grid, int opt, IScriptEnvironment* e
         }
 #ifndef _WIN32
         const char* error_str = dlerror();
-        env->ThrowError(
-            "FFTSpectrum: unable to load FFTW3 library (tried: %s). Error: %s", attempted_names.c_str(), error_str ? error_str : "unknown");
+        error = "unable to load FFTW3 library (tried: " + attempted_names + "). Error: " + (error_str ? error_str : "unknown");
 #else
-        env->ThrowError("FFTSpectrum: unable to load FFTW3 library (tried: %s). Error code: %lu", attempted_names.c_str(), GetLastError());
+        error = "unable to load FFTW3 library (tried: " + attempted_names + "). Error code: " + std::to_string(GetLastError());
 #endif
+        return nullptr;
     }
 
-    fftwf_plan_dft_2d = load_symbol_portable<fftwf_plan_dft_2d_type>(fftw3_lib_handle, "fftwf_plan_dft_2d");
-    fftwf_destroy_plan = load_symbol_portable<fftwf_destroy_plan_type>(fftw3_lib_handle, "fftwf_destroy_plan");
-    fftwf_execute_dft = load_symbol_portable<fftwf_execute_dft_type>(fftw3_lib_handle, "fftwf_execute_dft");
+    lib->fftwf_plan_many_dft_r2c =
+        load_symbol_portable<fftwf_plan_many_dft_r2c_type>(lib->fftw3_lib_handle, "fftwf_plan_many_dft_r2c");
+    lib->fftwf_destroy_plan = load_symbol_portable<fftwf_destroy_plan_type>(lib->fftw3_lib_handle, "fftwf_destroy_plan");
+    lib->fftwf_execute_dft_r2c = load_symbol_portable<fftwf_execute_dft_r2c_type>(lib->fftw3_lib_handle, "fftwf_execute_dft_r2c");
+    lib->fftwf_set_timelimit = load_symbol_portable<fftwf_set_timelimit_type>(lib->fftw3_lib_handle, "fftwf_set_timelimit");
+    lib->fftwf_flops = load_symbol_portable<fftwf_flops_type>(lib->fftw3_lib_handle, "fftwf_flops");
 
-    if (!fftwf_plan_dft_2d || !fftwf_destroy_plan || !fftwf_execute_dft)
+    if (!lib->fftwf_plan_many_dft_r2c || !lib->fftwf_destroy_plan || !lib->fftwf_execute_dft_r2c || !lib->fftwf_set_timelimit ||
+        !lib->fftwf_flops)
     {
-        if (fftw3_lib_handle)
+        error = "unable to find required functions in FFTW3 library.";
+        return nullptr;
+    }
+
+    lib->fftwf_import_wisdom_from_filename =
+        load_symbol_portable<fftwf_import_wisdom_from_filename_type>(lib->fftw3_lib_handle, "fftwf_import_wisdom_from_filename");
+    lib->fftwf_export_wisdom_to_filename =
+        load_symbol_portable<fftwf_export_wisdom_to_filename_type>(lib->fftw3_lib_handle, "fftwf_export_wisdom_to_filename");
+
+    lib->fftwf_init_threads = load_symbol_portable<fftwf_init_threads_type>(lib->fftw3_lib_handle, "fftwf_init_threads");
+    lib->fftwf_plan_with_nthreads = load_symbol_portable<fftwf_plan_with_nthreads_type>(lib->fftw3_lib_handle, "fftwf_plan_with_nthreads");
+
+    // Except the Windows builds (combined threads) the threads functions are in a separate library.
+    if (!lib->fftwf_init_threads || !lib->fftwf_plan_with_nthreads)
+    {
+#ifdef _WIN32
+        const char* fftw_threads_lib_names[] = {"libfftw3f_threads-3.dll"};
+#elif defined(__APPLE__)
+        const char* fftw_threads_lib_names[] = {
+            "libfftw3f_threads.3.dylib", "libfftw3f_threads.dylib", "libfftw3f_threads.so.3", "libfftw3f_threads.so"};
+#else
+        const char* fftw_threads_lib_names[] = {"libfftw3f_threads.so.3", "libfftw3f_threads.so"};
+#endif
+
+        for (const char* name : fftw_threads_lib_names)
         {
 #ifdef _WIN32
-            FreeLibrary(fftw3_lib_handle);
+            lib->fftw3_threads_lib_handle = LoadLibraryA(name);
 #else
-            dlclose(fftw3_lib_handle);
+            lib->fftw3_threads_lib_handle = dlopen(name, RTLD_LAZY | RTLD_LOCAL);
 #endif
-            fftw3_lib_handle = nullptr;
+            if (lib->fftw3_threads_lib_handle)
+                break;
+        }
+
+        if (lib->fftw3_threads_lib_handle)
+        {
+            lib->fftwf_init_threads = load_symbol_portable<fftwf_init_threads_type>(lib->fftw3_threads_lib_handle, "fftwf_init_threads");
+            lib->fftwf_plan_with_nthreads =
+                load_symbol_portable<fftwf_plan_with_nthreads_type>(lib->fftw3_threads_lib_handle, "fftwf_plan_with_nthreads");
         }
-        env->ThrowError("FFTSpectrum: unable to find required functions in FFTW3 library.");
     }
-#endif
+#endif // STATIC_FFTW
+
+    shared_fftw_library = lib;
 
-    const int64_t plane_size = vi.width * vi.height * sizeof(complex_float);
+    return lib;
+}
+
+// Called with the planner locked. Returns false if fftwf_init_threads fails.
+static bool init_fftw_threads(fftw_library& lib)
+{
+    if (!lib.threads_initialized.load(std::memory_order_relaxed))
+    {
+        if (!lib.fftwf_init_threads())
+            return false;
+
+        lib.threads_initialized.store(true, std::memory_order_release);
+    }
+
+    return true;
+}
+
+static constexpr int planes_yuv[] = {PLANAR_Y, PLANAR_U, PLANAR_V};
+static constexpr int planes_rgb[] = {PLANAR_G, PLANAR_B, PLANAR_R};
+
+// Size of the data of the planes in bytes.
+static size_t frame_data_size(const PVideoFrame& frame, const VideoInfo& vi)
+{
+    constexpr int planes[] = {PLANAR_Y, PLANAR_U, PLANAR_V, PLANAR_A};
+    size_t size = 0;
+
+    for (int i = 0; i < vi.NumComponents(); ++i)
+        size += static_cast<size_t>(frame->GetPitch(planes[i])) * frame->GetHeight(planes[i]);
+
+    return size;
+}
+
+static void draw_grid(uint8_t* buf, int width, int height, int stride)
+{
+    for (int x = (width / 2) % 100; x < width; x += 100)
+    {
+        for (int y = 0; y < height; ++y)
+            buf[x + y * stride] = 255;
+    }
+
+    for (int y = (height / 2) % 100; y < height; y += 100)
+    {
+        for (int x = 0; x < width; ++x)
+            buf[x + y * stride] = 255;
+    }
+}
+
+FFTSpectrum::FFTSpectrum(PClip _child, bool grid, int opt, const char* wisdom, int threads, int planner, double plan_timelimit,
+    int engine, bool inplace, int prefetch, int cache, bool dedup, bool async_plan, const AVSValue& planes, int roi_left, int roi_top,
+    int roi_width, int roi_height, bool fields, IScriptEnvironment* env)
+    : GenericVideoFilter(_child),
+      m_grid(grid),
+      m_inplace(inplace),
+      num_fields((fields) ? 2 : 1),
+      m_dedup(dedup),
+      live_workspaces(0)
+{
+    if (!vi.IsPlanar() && !vi.IsYUY2())
+        env->ThrowError("FFTSpectrum: clip must be in YUV planar, RGB planar or YUY2 format.");
+
+    plane_ids = (vi.IsRGB()) ? planes_rgb : planes_yuv;
+
+    // YUY2: only the luma (read from the packed pixels).
+    const int num_planes = (vi.IsY() || vi.IsYUY2()) ? 1 : 3;
+    process_planes = {};
+
+    if (planes.Defined())
+    {
+        for (int i = 0; i < planes.ArraySize(); ++i)
+        {
+            const int plane = planes[i].AsInt();
+
+            if (plane < 0 || plane >= num_planes)
+                env->ThrowError("FFTSpectrum: plane index out of range.");
+
+            if (process_planes[plane])
+                env->ThrowError("FFTSpectrum: plane specified twice.");
+
+            process_planes[plane] = true;
+        }
+    }
+    else if (vi.IsRGB())
+        process_planes = {true, true, true};
+    else
+        process_planes[0] = true;
+
+    // Like Crop: width/height <= 0 are relative to the right/bottom edge.
+    if (roi_width <= 0)
+        roi_width += vi.width - roi_left;
+
+    if (roi_height <= 0)
+        roi_height += vi.height - roi_top;
+
+    if (roi_left < 0 || roi_top < 0 || roi_width <= 0 || roi_height <= 0 || roi_left + roi_width > vi.width ||
+        roi_top + roi_height > vi.height)
+        env->ThrowError("FFTSpectrum: the region is outside of the frame.");
+
+    if (process_planes[1] || process_planes[2])
+    {
+        const int mod_w = 1 << vi.GetPlaneWidthSubsampling(plane_ids[1]);
+        const int mod_h = 1 << vi.GetPlaneHeightSubsampling(plane_ids[1]);
+
+        if (roi_left % mod_w || roi_width % mod_w)
+            env->ThrowError("FFTSpectrum: left and width must be multiples of %d for the chroma planes.", mod_w);
+
+        if (roi_top % mod_h || roi_height % mod_h)
+            env->ThrowError("FFTSpectrum: top and height must be multiples of %d for the chroma planes.", mod_h);
+    }
+
+    if (fields)
+    {
+        // Both fields of every plane have the same number of lines and the region starts with a line of the top field.
+        const int mod_h = (process_planes[1] || process_planes[2]) ? 2 << vi.GetPlaneHeightSubsampling(plane_ids[1]) : 2;
+
+        if (roi_top % mod_h || roi_height % mod_h)
+            env->ThrowError("FFTSpectrum: top and height must be multiples of %d for fields=true.", mod_h);
+    }
+
+    // The transforms and the output have the dimensions of the region. The source is read at its position, without a copy.
+    vi.width = roi_width;
+    vi.height = roi_height;
+
+    if (engine < -1 || engine > 1)
+        env->ThrowError("FFTSpectrum: engine must be between -1..1.");
+
+    // engine=-1 falls back to the built-in FFT when FFTW can't be loaded.
+    bool use_fftw = engine != 1;
+
+    if (use_fftw)
+    {
+        std::string error;
+        fftw_lib = acquire_fftw_library(error);
+
+        if (!fftw_lib && engine == 0)
+            env->ThrowError("FFTSpectrum: %s", error.c_str());
+
+        use_fftw = fftw_lib != nullptr;
+    }
+
+    const bool use_wisdom = use_fftw && wisdom && *wisdom;
+
+    if (use_wisdom && (!fftw_lib->fftwf_import_wisdom_from_filename || !fftw_lib->fftwf_export_wisdom_to_filename))
+        env->ThrowError("FFTSpectrum: unable to find the wisdom functions in FFTW3 library.");
+
+    if (threads < 0)
+        env->ThrowError("FFTSpectrum: threads must be greater than or equal to 0.");
+
+    if (threads == 0)
+        threads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+
+    // The stages around the transform are split into row bands for both engines.
+    m_threads = threads;
+
+    if (m_threads > 1)
+        stage_workers = acquire_worker_pool();
+
+    // Threads of the transform. The built-in FFT is single-threaded, FFTW without the threads functions too (the other stages still
+    // use m_threads).
+    if (!use_fftw || !fftw_lib->fftwf_init_threads || !fftw_lib->fftwf_plan_with_nthreads)
+        threads = 1;
 
     if (opt < -1 || opt > 3)
         env->ThrowError("FFTSpectrum: opt must be between -1..3.");
@@ -171,100 +658,691 @@ FFTSpectrum::FFTSpectrum(PClip _child, bool grid, int opt, IScriptEnvironment* e
     if (!sse2 && opt == 1)
         env->ThrowError("FFTSpectrum: opt=1 requires SSE2.");
 
+    const int component_size = vi.ComponentSize();
+    auto select_fill = [component_size, yuy2 = vi.IsYUY2()](auto fill_uint8, auto fill_uint16, auto fill_float, auto fill_yuy2) {
+        return (yuy2) ? fill_yuy2 : (component_size == 1) ? fill_uint8 : (component_size == 2) ? fill_uint16 : fill_float;
+    };
+
+    // The samples are scaled to the 8-bit range, so the spectrum doesn't depend on the bit depth.
+    sample_scale = (component_size == 4) ? 255.0f : 255.0f / static_cast<float>((1 << vi.BitsPerComponent()) - 1);
+
     if (avx512)
     {
-        fill_fft_input_array = fill_fft_input_array_avx512;
+        fill_fft_input_array =
+            select_fill(fill_fft_input_array_avx512<uint8_t>, fill_fft_input_array_avx512<uint16_t>, fill_fft_input_array_avx512<float>,
+                fill_fft_input_array_avx512<yuy2_luma>);
         calculate_absolute_values = calculate_absolute_values_avx512;
+        builtin_fft_r2c_2d = builtin_fft_r2c_2d_avx512;
+        draw_fft_spectrum = draw_fft_spectrum_avx512;
     }
     else if (avx2)
     {
-        fill_fft_input_array = fill_fft_input_array_avx2;
+        fill_fft_input_array =
+            select_fill(fill_fft_input_array_avx2<uint8_t>, fill_fft_input_array_avx2<uint16_t>, fill_fft_input_array_avx2<float>,
+                fill_fft_input_array_avx2<yuy2_luma>);
         calculate_absolute_values = calculate_absolute_values_avx2;
+        builtin_fft_r2c_2d = builtin_fft_r2c_2d_avx2;
+        draw_fft_spectrum = draw_fft_spectrum_avx2;
     }
     else if (sse2)
     {
-        fill_fft_input_array = fill_fft_input_array_sse2;
+        fill_fft_input_array =
+            select_fill(fill_fft_input_array_sse2<uint8_t>, fill_fft_input_array_sse2<uint16_t>, fill_fft_input_array_sse2<float>,
+                fill_fft_input_array_sse2<yuy2_luma>);
         calculate_absolute_values = calculate_absolute_values_sse2;
+        builtin_fft_r2c_2d = builtin_fft_r2c_2d_sse2;
+        draw_fft_spectrum = draw_fft_spectrum_sse2;
     }
     else
     {
-        fill_fft_input_array = fill_fft_input_array_c;
+        fill_fft_input_array =
+            select_fill(fill_fft_input_array_c<uint8_t>, fill_fft_input_array_c<uint16_t>, fill_fft_input_array_c<float>,
+                fill_fft_input_array_c<yuy2_luma>);
         calculate_absolute_values = calculate_absolute_values_c;
+        builtin_fft_r2c_2d = builtin_fft_r2c_2d_c;
+        draw_fft_spectrum = draw_fft_spectrum_c;
     }
 
     const int alignment = (avx512) ? 64 : 32;
+    m_alignment = alignment;
 
-    fft_in = make_unique_aligned_array_fp<complex_float>(plane_size, alignment);
-    fft_out = make_unique_aligned_array_fp<complex_float>(plane_size, alignment);
-    abs_array = make_unique_aligned_array_fp<float>(vi.width * vi.height * sizeof(float), alignment);
+    has_at_least_v8 = env->FunctionExists("propShow");
 
-    if (!fft_in)
-        env->ThrowError("FFTSpectrum: _aligned_malloc failure (fft_in).");
+    if (prefetch < 0)
+        env->ThrowError("FFTSpectrum: prefetch must be greater than or equal to 0.");
 
-    if (!fft_out)
-        env->ThrowError("FFTSpectrum: _aligned_malloc failure (fft_out).");
+    // The source frames are requested ahead by the Prefetch of the core - it respects the MT modes of the source filters.
+    if (prefetch > 0)
+    {
+        if (!env->FunctionExists("Prefetch"))
+            env->ThrowError("FFTSpectrum: prefetch requires AviSynth+ (Prefetch).");
 
-    if (!abs_array)
-        env->ThrowError("FFTSpectrum: _aligned_malloc failure (abs_array).");
+        const AVSValue prefetch_args[3]{child, 1, prefetch};
+        child = env->Invoke("Prefetch", AVSValue(prefetch_args, 3)).AsClip();
+    }
 
+    if (cache < 0)
+        env->ThrowError("FFTSpectrum: cache must be greater than or equal to 0.");
+
+    // The planes with the same dimensions are one group: U and V (all planes of 4:4:4) are a single batch.
+    num_groups = 0;
+
+    for (int plane = 0; plane < num_planes; ++plane)
     {
-        const std::lock_guard<std::mutex> lock(fftwf_plan_mutex);
-        p = fftwf_plan_dft_2d(vi.height, vi.width, reinterpret_cast<fftwf_complex*>(fft_in.get()),
-            reinterpret_cast<fftwf_complex*>(fft_out.get()), FFTW_FORWARD, FFTW_MEASURE | FFTW_DESTROY_INPUT);
+        if (!process_planes[plane])
+            continue;
+
+        const int ssw = vi.GetPlaneWidthSubsampling(plane_ids[plane]);
+        const int ssh = vi.GetPlaneHeightSubsampling(plane_ids[plane]);
+        const int width = vi.width >> ssw;
+        const int height = (vi.height >> ssh) / num_fields;
+        plane_group* group = nullptr;
+
+        for (int i = 0; i < num_groups; ++i)
+        {
+            if (groups[i].width == width && groups[i].height == height)
+                group = &groups[i];
+        }
+
+        if (!group)
+        {
+            group = &groups[num_groups++];
+            group->count = 0;
+            group->width = width;
+            group->height = height;
+            group->src_left = (roi_left >> ssw) * ((vi.IsYUY2()) ? 2 : vi.ComponentSize());
+            group->src_top = roi_top >> ssh;
+        }
+
+        group->planes[group->count++] = plane;
+        group->batch = group->count * num_fields;
     }
 
-    if (vi.NumComponents() > 1)
+    if (planner < 0 || planner > 3)
+        env->ThrowError("FFTSpectrum: planner must be between 0..3.");
+
+    if (plan_timelimit < 0.0 && plan_timelimit != FFTW_NO_TIMELIMIT)
+        env->ThrowError("FFTSpectrum: plan_timelimit must be greater than or equal to 0.0 or -1.0.");
+
+    constexpr unsigned planner_rigor[] = {FFTW_ESTIMATE, FFTW_MEASURE, FFTW_PATIENT, FFTW_EXHAUSTIVE};
+    const unsigned plan_flags = planner_rigor[planner] | FFTW_DESTROY_INPUT;
+
+    // async_plan: if the planner is busy (measuring for another instance), the built-in FFT is used until the plans are created in
+    // the background instead of waiting for it. Otherwise the planner is kept until the initial plans are created.
+    const bool plan_async = use_fftw && async_plan && planner > 0;
+    std::optional<fftw_planner_lock> async_planner_lock;
+
+    if (plan_async)
+        async_planner_lock.emplace(std::try_to_lock);
+
+    const bool planner_busy = plan_async && !async_planner_lock->owns_lock();
+
+    // The threads are initialized by the first plan with threads > 1. It's done here to report the failure, but not when the planner
+    // is busy with async_plan - then it's done by the background planning.
+    if (use_fftw && threads > 1 && !planner_busy && !fftw_lib->threads_initialized.load(std::memory_order_acquire))
+    {
+        std::optional<fftw_planner_lock> planner_lock;
+
+        if (!plan_async)
+            planner_lock.emplace();
+
+        if (!init_fftw_threads(*fftw_lib))
+            env->ThrowError("FFTSpectrum: fftwf_init_threads failure.");
+    }
+
+    // Rounds up the number of elements to a multiple of the alignment.
+    auto align_elements = [alignment](size_t size, size_t element_size) {
+        const size_t elements = alignment / element_size;
+        return (size + elements - 1) / elements * elements;
+    };
+
+    fft_in_size = 0;
+    fft_out_size = 0;
+    abs_size = 0;
+    builtin_work_size = 0;
+
+    for (int i = 0; i < num_groups; ++i)
+    {
+        plane_group& group = groups[i];
+        group.centered = group.width % 2 == 0 && group.height % 2 == 0;
+        // In-place: the rows of the real input are padded to 2 * (width / 2 + 1) floats and the output overwrites them.
+        group.fft_in_stride = (m_inplace) ? 2 * (group.width / 2 + 1) : group.width;
+        group.plane_size = static_cast<size_t>(group.fft_in_stride) * group.height;
+        group.spectrum_size = static_cast<size_t>(group.width / 2 + 1) * group.height;
+
+        // The groups start at aligned addresses (FFTW uses the SIMD codelets only for aligned arrays).
+        group.in_offset = align_elements(fft_in_size, sizeof(float));
+        fft_in_size = group.in_offset + group.plane_size * group.batch;
+
+        if (!m_inplace)
+        {
+            group.out_offset = align_elements(fft_out_size, sizeof(complex_float));
+            fft_out_size = group.out_offset + group.spectrum_size * group.batch;
+        }
+        else
+            group.out_offset = group.in_offset / 2;
+
+        // The magnitudes are calculated and drawn one plane at a time.
+        abs_size = std::max(abs_size, group.spectrum_size);
+
+        if (!use_fftw || planner_busy)
+        {
+            group.builtin_plan = std::make_unique<builtin_fft_plan>(group.height, group.width);
+            builtin_work_size = std::max(builtin_work_size, group.builtin_plan->work_size());
+        }
+    }
+
+    workspace_size = (fft_in_size + abs_size + builtin_work_size) * sizeof(float) + fft_out_size * sizeof(complex_float);
+
+    // The first workspace of the pool, FFTW plans with it.
+    std::unique_ptr<fft_workspace> workspace = create_workspace(env);
+
+    // Called with the planner locked. The measuring planners overwrite in and out.
+    // Everything is captured by value - it's also called by the background planning.
+    auto create_plan = [lib = fftw_lib, threads, plan_timelimit](const plane_group& group, unsigned flags, float* in, fftwf_complex* out) {
+        if (threads > 1)
+        {
+            if (!init_fftw_threads(*lib))
+                return fftwf_plan{};
+
+            lib->fftwf_plan_with_nthreads(threads);
+        }
+
+        lib->fftwf_set_timelimit(plan_timelimit);
+
+        // The planes (fields) of the group are a batch. The rows of the input are fft_in_stride floats (padded for in-place).
+        const int n[]{group.height, group.width};
+        const int inembed[]{group.height, group.fft_in_stride};
+        const int onembed[]{group.height, group.width / 2 + 1};
+
+        const fftwf_plan plan = lib->fftwf_plan_many_dft_r2c(2, n, group.batch, in, inembed, 1, static_cast<int>(group.plane_size), out,
+            onembed, 1, static_cast<int>(group.spectrum_size), flags);
+
+        // The planner state is global - the instances that don't use threads expect the default.
+        if (threads > 1)
+            lib->fftwf_plan_with_nthreads(1);
+
+        lib->fftwf_set_timelimit(FFTW_NO_TIMELIMIT);
+
+        return plan;
+    };
+
+    // The plan with the requested rigor.
+    auto create_measured_plan = [lib = fftw_lib, create_plan, plan_flags, wisdom_path = std::string((use_wisdom) ? wisdom : "")](
+                                    const plane_group& group, float* in, fftwf_complex* out) {
+        fftwf_plan plan = nullptr;
+
+        if (!wisdom_path.empty())
+        {
+            // A missing file is not an error - it is created after the first measurement.
+            lib->fftwf_import_wisdom_from_filename(wisdom_path.c_str());
+            plan = create_plan(group, plan_flags | FFTW_WISDOM_ONLY, in, out);
+        }
+
+        if (!plan)
+        {
+            plan = create_plan(group, plan_flags, in, out);
+
+            // The wisdom file could be read-only (shared) - the plan is used without updating it.
+            if (plan && !wisdom_path.empty())
+                lib->fftwf_export_wisdom_to_filename(wisdom_path.c_str());
+        }
+
+        return plan;
+    };
+
+    auto plan_key = [alignment, threads, inplace = m_inplace](const plane_group& group, unsigned flags) {
+        return fftw_plan_key{fftw_transform_kind::r2c_2d, group.height, group.width, group.batch, flags, alignment, threads, inplace};
+    };
+
+    if (use_fftw)
+    {
+        // The groups that use FFTW_ESTIMATE or the built-in FFT until the measured plan is ready.
+        std::vector<int> measure_in_background;
+        std::array<std::shared_ptr<const fftw_transform>, 3> plans;
+
+        for (int i = 0; i < num_groups; ++i)
+        {
+            plane_group& group = groups[i];
+            float* in = workspace->fft_in.get() + group.in_offset;
+            fftwf_complex* out =
+                reinterpret_cast<fftwf_complex*>((m_inplace) ? in : reinterpret_cast<float*>(workspace->fft_out.get() + group.out_offset));
+            const fftw_plan_key key = plan_key(group, plan_flags);
+
+            if (!plan_async)
+            {
+                plans[i] = acquire_shared_plan(key, [&]() { return create_measured_plan(group, in, out); }, fftw_lib);
+                continue;
+            }
+
+            // Already planned by another instance.
+            plans[i] = find_shared_plan(key);
+
+            if (plans[i])
+                continue;
+
+            if (planner_busy)
+            {
+                measure_in_background.emplace_back(i);
+                continue;
+            }
+
+            // Stored in the wisdom.
+            if (use_wisdom)
+            {
+                plans[i] = acquire_shared_plan_locked(
+                    key,
+                    [&]() {
+                        fftw_lib->fftwf_import_wisdom_from_filename(wisdom);
+                        return create_plan(group, plan_flags | FFTW_WISDOM_ONLY, in, out);
+                    },
+                    fftw_lib);
+            }
+
+            if (!plans[i])
+            {
+                const unsigned estimate_flags = FFTW_ESTIMATE | FFTW_DESTROY_INPUT;
+
+                plans[i] = acquire_shared_plan_locked(
+                    plan_key(group, estimate_flags), [&]() { return create_plan(group, estimate_flags, in, out); }, fftw_lib);
+
+                if (plans[i])
+                    measure_in_background.emplace_back(i);
+            }
+        }
+
+        // Before anything can throw - the plans that are released on the error need the planner.
+        async_planner_lock.reset();
+
+        for (int i = 0; i < num_groups; ++i)
+        {
+            if (plans[i])
+                store_transform(groups[i], std::move(plans[i]));
+            else if (!groups[i].builtin_plan)
+                env->ThrowError("FFTSpectrum: unable to create FFTW plan.");
+        }
+
+        if (!measure_in_background.empty())
+        {
+            // The dimensions of the groups that are measured (the planning doesn't access the instance).
+            std::vector<std::pair<int, plane_group>> measurements;
+
+            for (int i : measure_in_background)
+            {
+                plane_group& geometry = measurements.emplace_back(i, plane_group{}).second;
+                geometry.width = groups[i].width;
+                geometry.height = groups[i].height;
+                geometry.batch = groups[i].batch;
+                geometry.fft_in_stride = groups[i].fft_in_stride;
+                geometry.plane_size = groups[i].plane_size;
+                geometry.spectrum_size = groups[i].spectrum_size;
+            }
+
+            plan_upgrade = std::make_shared<plan_upgrade_state>();
+            plan_upgrade->owner = this;
+
+            // The instance can be destroyed while it's measuring.
+            pin_plugin_module();
+
+            // The previous plan (or the built-in FFT) is kept if the measured one can't be created.
+            // The groups aren't copyable, std::function requires it from the captures.
+            fftwf_background_planner.run([state = plan_upgrade,
+                                             measurements = std::make_shared<const decltype(measurements)>(std::move(measurements)),
+                                             lib = fftw_lib, plan_key, plan_flags, create_measured_plan, alignment = m_alignment,
+                                             inplace = m_inplace]() {
+                for (const auto& [index, group] : *measurements)
+                {
+                    if (fftwf_background_planner.stop_requested())
+                        return;
+
+                    // The remaining measurements of a destroyed instance are skipped.
+                    {
+                        const std::lock_guard<std::mutex> lock(state->mutex);
+
+                        if (!state->owner)
+                            return;
+                    }
+
+                    // The measurements overwrite the buffers - the workspaces can be in use.
+                    aligned_unique_ptr<float> measure_in = make_unique_aligned_array_fp<float>(group.plane_size * group.batch, alignment);
+                    aligned_unique_ptr<complex_float> measure_out;
+
+                    if (!inplace)
+                        measure_out = make_unique_aligned_array_fp<complex_float>(group.spectrum_size * group.batch, alignment);
+
+                    if (!measure_in || (!inplace && !measure_out))
+                        continue;
+
+                    float* in = measure_in.get();
+                    fftwf_complex* out = reinterpret_cast<fftwf_complex*>((inplace) ? in : reinterpret_cast<float*>(measure_out.get()));
+                    // Released after state->mutex if the instance is already destroyed.
+                    std::shared_ptr<const fftw_transform> transform =
+                        acquire_shared_plan(plan_key(group, plan_flags), [&]() { return create_measured_plan(group, in, out); }, lib);
+
+                    if (!transform)
+                        continue;
+
+                    const std::lock_guard<std::mutex> lock(state->mutex);
+
+                    if (state->owner)
+                        state->owner->store_transform(state->owner->groups[index], std::move(transform));
+                }
+            });
+        }
+    }
+
+    workspaces.release(std::move(workspace));
+
+    // Only luma: Y8. Otherwise the 8-bit format of the clip with the spectra in the processed planes.
+    if (!vi.IsRGB() && !process_planes[1] && !process_planes[2])
         vi.pixel_type = VideoInfo::CS_Y8;
+    else
+        vi.pixel_type = (vi.pixel_type & ~VideoInfo::CS_Sample_Bits_Mask) | VideoInfo::CS_Sample_Bits_8;
 
-    has_at_least_v8 = env->FunctionExists("propShow");
+    output_cache.set_capacity(static_cast<size_t>(cache) << 20);
 }
 
-FFTSpectrum::~FFTSpectrum()
+std::shared_ptr<const fftw_transform> FFTSpectrum::load_transform(const plane_group& group) const
+{
+    const std::lock_guard<std::mutex> lock(transform_mutex);
+    return group.transform;
+}
+
+void FFTSpectrum::store_transform(plane_group& group, std::shared_ptr<const fftw_transform> transform)
+{
+    const std::lock_guard<std::mutex> lock(transform_mutex);
+
+    // Kept until the destructor - a GetFrame call that still uses the replaced plan would release it otherwise.
+    if (group.transform)
+        retired_transforms.emplace_back(std::move(group.transform));
+
+    group.transform = std::move(transform);
+}
+
+std::unique_ptr<fft_workspace> FFTSpectrum::create_workspace(IScriptEnvironment* env)
 {
+    // The workspaces move between the threads through the pool and outlive the environment that created them - aligned_malloc is used
+    // instead of the allocator of the core.
+    auto workspace = std::make_unique<fft_workspace>();
+    workspace->fft_in = make_unique_aligned_array_fp<float>(fft_in_size, m_alignment);
+    workspace->abs_array = make_unique_aligned_array_fp<float>(abs_size, m_alignment);
+
+    if (!m_inplace)
+        workspace->fft_out = make_unique_aligned_array_fp<complex_float>(fft_out_size, m_alignment);
+
+    if (!workspace->fft_in)
+        env->ThrowError("FFTSpectrum: _aligned_malloc failure (fft_in).");
+
+    if (!m_inplace && !workspace->fft_out)
+        env->ThrowError("FFTSpectrum: _aligned_malloc failure (fft_out).");
+
+    if (!workspace->abs_array)
+        env->ThrowError("FFTSpectrum: _aligned_malloc failure (abs_array).");
+
+    if (builtin_work_size)
     {
-        const std::lock_guard<std::mutex> lock(fftwf_plan_mutex);
-        fftwf_destroy_plan(p);
+        workspace->builtin_work = make_unique_aligned_array_fp<float>(builtin_work_size, m_alignment);
+
+        if (!workspace->builtin_work)
+            env->ThrowError("FFTSpectrum: _aligned_malloc failure (builtin_work).");
+
+        // The padding of the transposed array is read (and ignored) but never written.
+        memset(workspace->builtin_work.get(), 0, builtin_work_size * sizeof(float));
     }
 
-#ifndef STATIC_FFTW
-    if (fftw3_lib_handle)
+    live_workspaces.fetch_add(1, std::memory_order_relaxed);
+    workspace->live_count = &live_workspaces;
+
+    return workspace;
+}
+
+FFTSpectrum::~FFTSpectrum()
+{
+    // The background planning isn't waited for - the measurement in progress finishes, the rest of them are skipped.
+    if (plan_upgrade)
     {
-#ifdef _WIN32
-        FreeLibrary(fftw3_lib_handle);
-#else
-        dlclose(fftw3_lib_handle);
-#endif
-        fftw3_lib_handle = nullptr;
+        const std::lock_guard<std::mutex> lock(plan_upgrade->mutex);
+        plan_upgrade->owner = nullptr;
     }
-#endif
 }
 
 PVideoFrame __stdcall FFTSpectrum::GetFrame(int n, IScriptEnvironment* env)
 {
+    if (output_cache.get_capacity())
+    {
+        if (PVideoFrame cached = output_cache.lookup(n))
+            return cached;
+    }
 
     PVideoFrame src = child->GetFrame(n, env);
-    const int width = src->GetRowSize();
-    const int height = src->GetHeight();
 
-    fill_fft_input_array(fft_in.get(), src->GetReadPtr(), width, height, src->GetPitch());
+    std::unique_ptr<fft_workspace> workspace = workspaces.acquire();
+
+    if (!workspace)
+        workspace = create_workspace(env);
+
+    float* fft_in = workspace->fft_in.get();
+    float* abs_array = workspace->abs_array.get();
+
+    std::atomic<uint64_t> hash{0};
+
+    for (int g = 0; g < num_groups; ++g)
+    {
+        const plane_group& group = groups[g];
+
+        for (int i = 0; i < group.batch; ++i)
+        {
+            const int plane = group.planes[i / num_fields];
+            const int field = i % num_fields;
+            float* plane_in = fft_in + group.in_offset + i * group.plane_size;
+            const int plane_pitch = src->GetPitch(plane_ids[plane]);
+            // A field is every other line of the plane.
+            const int src_pitch = plane_pitch * num_fields;
+            const uint8_t* srcp =
+                src->GetReadPtr(plane_ids[plane]) + static_cast<ptrdiff_t>(group.src_top + field) * plane_pitch + group.src_left;
+
+            // The bands start at even rows - the sign of the modulation depends on the parity of the row.
+            run_in_bands(stage_workers.get(), m_threads, group.height, 2, [&](int y_begin, int y_end) {
+                const uint64_t band_hash = fill_fft_input_array(plane_in + static_cast<ptrdiff_t>(y_begin) * group.fft_in_stride,
+                    srcp + static_cast<ptrdiff_t>(y_begin) * src_pitch, group.width, y_end - y_begin, src_pitch, group.fft_in_stride,
+                    sample_scale, group.centered, m_dedup);
+
+                // The band hashes are keyed by the plane, the field and the first row, so the sum doesn't depend on the order in which
+                // the bands finish.
+                if (m_dedup)
+                {
+                    const uint64_t band_key = (static_cast<uint64_t>(plane) << 62) | (static_cast<uint64_t>(field) << 61) |
+                        (static_cast<uint64_t>(y_begin) << 32);
+                    hash.fetch_add(content_hash::finalize(band_hash ^ band_key), std::memory_order_relaxed);
+                }
+            });
+        }
+    }
+
+    std::optional<std::promise<PVideoFrame>> rendered;
+
+    if (m_dedup)
+    {
+        PVideoFrame previous;
+        rendered.emplace();
+
+        if (const std::shared_future<PVideoFrame> match = match_previous_frame(n, hash.load(std::memory_order_relaxed), *rendered);
+            match.valid())
+        {
+            // Frame n - 1 can be still rendered by another thread. If it fails, this one is rendered.
+            try
+            {
+                previous = match.get();
+            }
+            catch (const std::future_error&)
+            {
+            }
+        }
+
+        if (previous)
+        {
+            workspaces.release(std::move(workspace));
+
+            // The spectrum is the same - the new frame shares the buffer of the previous one and gets the properties of the current
+            // source frame.
+            PVideoFrame dst = previous;
 
-    fftwf_execute_dft(p, reinterpret_cast<fftwf_complex*>(fft_in.get()), reinterpret_cast<fftwf_complex*>(fft_out.get()));
+            if (has_at_least_v8)
+            {
+                if (vi.NumComponents() == 1)
+                    dst = env->Subframe(previous, 0, previous->GetPitch(), previous->GetRowSize(), previous->GetHeight());
+                else if (vi.NumComponents() == 3)
+                    dst = env->SubframePlanar(previous, 0, previous->GetPitch(), previous->GetRowSize(), previous->GetHeight(), 0, 0,
+                        previous->GetPitch(PLANAR_U));
+                else
+                    dst = env->SubframePlanarA(previous, 0, previous->GetPitch(), previous->GetRowSize(), previous->GetHeight(), 0, 0,
+                        previous->GetPitch(PLANAR_U), 0);
+
+                env->copyFrameProps(src, dst);
+                set_frame_properties(dst, env);
+            }
 
-    calculate_absolute_values(abs_array.get(), fft_out.get(), (width * height));
+            if (output_cache.get_capacity())
+                output_cache.insert(n, dst, frame_data_size(dst, vi));
+
+            return dst;
+        }
+    }
 
     PVideoFrame dst = has_at_least_v8 ? env->NewVideoFrameP(vi, &src) : env->NewVideoFrame(vi);
 
-    draw_fft_spectrum(dst->GetWritePtr(), abs_array.get(), width, height, dst->GetPitch());
+    for (int g = 0; g < num_groups; ++g)
+    {
+        const plane_group& group = groups[g];
+        float* group_in = fft_in + group.in_offset;
+        complex_float* group_out =
+            (m_inplace) ? reinterpret_cast<complex_float*>(group_in) : workspace->fft_out.get() + group.out_offset;
+
+        if (const std::shared_ptr<const fftw_transform> fftw = load_transform(group))
+            fftw_lib->fftwf_execute_dft_r2c(fftw->plan.get(), group_in, reinterpret_cast<fftwf_complex*>(group_out));
+        else
+        {
+            for (int i = 0; i < group.batch; ++i)
+                builtin_fft_r2c_2d(*group.builtin_plan, group_in + i * group.plane_size, group.fft_in_stride,
+                    group_out + i * group.spectrum_size, workspace->builtin_work.get());
+        }
+
+        const int width = group.width;
+        const int height = group.height;
+        // The DC component is excluded from the maximum.
+        const int dc_index = (group.centered) ? (height / 2) * (width / 2 + 1) + width / 2 : 0;
+
+        for (int i = 0; i < group.batch; ++i)
+        {
+            const complex_float* fft_out = group_out + i * group.spectrum_size;
+            std::atomic<float> max_sq{0.0f};
+
+            // The bands are multiples of the unrolled loops of the kernels, only the last one has a scalar tail.
+            run_in_bands(stage_workers.get(), m_threads, (width / 2 + 1) * height, 64, [&](int begin, int end) {
+                const float band_max_sq = calculate_absolute_values(abs_array + begin, fft_out + begin, end - begin, dc_index - begin);
+                float current = max_sq.load(std::memory_order_relaxed);
+
+                while (band_max_sq > current && !max_sq.compare_exchange_weak(current, band_max_sq, std::memory_order_relaxed))
+                {
+                }
+            });
+
+            // The spectrum of the bottom field is below the one of the top field.
+            const int dst_pitch = dst->GetPitch(plane_ids[group.planes[i / num_fields]]);
+            uint8_t* dstp =
+                dst->GetWritePtr(plane_ids[group.planes[i / num_fields]]) + static_cast<ptrdiff_t>(i % num_fields) * height * dst_pitch;
+
+            run_in_bands(stage_workers.get(), m_threads, height, 1, [&](int y_begin, int y_end) {
+                draw_fft_spectrum(
+                    dstp, abs_array, width, height, dst_pitch, max_sq.load(std::memory_order_relaxed), group.centered, y_begin, y_end);
+            });
+
+            if (m_grid)
+                draw_grid(dstp, width, height, dst_pitch);
+        }
+    }
+
+    workspaces.release(std::move(workspace));
+
+    if (vi.NumComponents() > 1)
+    {
+        // The planes that aren't processed: black luma and RGB, neutral chroma, opaque alpha.
+        const int blank_chroma = (vi.IsRGB()) ? 0 : 128;
+
+        for (int i = 0; i < vi.NumComponents(); ++i)
+        {
+            if (i < 3 && process_planes[i])
+                continue;
+
+            const int plane = (i < 3) ? plane_ids[i] : PLANAR_A;
+            const int blank = (i == 3) ? 255 : (i == 0) ? 0 : blank_chroma;
+
+            memset(dst->GetWritePtr(plane), blank, static_cast<size_t>(dst->GetPitch(plane)) * dst->GetHeight(plane));
+        }
+    }
+
+    if (has_at_least_v8)
+        set_frame_properties(dst, env);
+
+    if (rendered)
+        rendered->set_value(dst);
 
-    if (m_grid)
-        draw_grid(dst->GetWritePtr(), width, height, dst->GetPitch());
+    if (output_cache.get_capacity())
+        output_cache.insert(n, dst, frame_data_size(dst, vi));
 
     return dst;
 }
 
+void FFTSpectrum::set_frame_properties(PVideoFrame& dst, IScriptEnvironment* env)
+{
+    AVSMap* props = env->getFramePropsRW(dst);
+
+    if (fftw_lib)
+    {
+        double flops = 0.0;
+
+        // 0 while the built-in FFT is used (async_plan).
+        for (int i = 0; i < num_groups; ++i)
+        {
+            if (const std::shared_ptr<const fftw_transform> fftw = load_transform(groups[i]))
+                flops += fftw->flops;
+        }
+
+        env->propSetFloat(props, "FFTSpectrumPlanFlops", flops, PROPAPPENDMODE_REPLACE);
+    }
+
+    env->propSetInt(props, "FFTSpectrumWorkingSet",
+        static_cast<int64_t>(workspace_size * live_workspaces.load(std::memory_order_relaxed)), PROPAPPENDMODE_REPLACE);
+}
+
+std::shared_future<PVideoFrame> FFTSpectrum::match_previous_frame(int n, uint64_t hash, std::promise<PVideoFrame>& rendered)
+{
+    const std::lock_guard<std::mutex> lock(dedup_mutex);
+
+    std::shared_future<PVideoFrame> previous;
+
+    if (const auto it = dedup_history.find(n - 1); it != dedup_history.end() && it->second.hash == hash)
+        previous = it->second.frame;
+
+    // A run of the same frames is matched frame by frame - the next one gets the output of frame n - 1 too.
+    dedup_history.insert_or_assign(n, dedup_entry{hash, (previous.valid()) ? previous : rendered.get_future().share()});
+
+    // The frames farthest from n are dropped (the frame numbers of the requests are close to each other unless seeking).
+    while (dedup_history.size() > dedup_history_size)
+    {
+        const auto last = std::prev(dedup_history.end());
+        dedup_history.erase((n - dedup_history.begin()->first > last->first - n) ? dedup_history.begin() : last);
+    }
+
+    return previous;
+}
+
 AVSValue __cdecl Create_FFTSpectrum(AVSValue args, void* user_data, IScriptEnvironment* env)
 {
-    return new FFTSpectrum(args[0].AsClip(), args[1].AsBool(false), args[2].AsInt(1), env);
+    return new FFTSpectrum(args[0].AsClip(), args[1].AsBool(false), args[2].AsInt(1), args[3].AsString(""), args[4].AsInt(1),
+        args[5].AsInt(1), args[6].AsFloat(FFTW_NO_TIMELIMIT), args[7].AsInt(-1), args[8].AsBool(false), args[9].AsInt(0), args[10].AsInt(0),
+        args[11].AsBool(false), args[12].AsBool(false), args[13], args[14].AsInt(0), args[15].AsInt(0), args[16].AsInt(0),
+        args[17].AsInt(0), args[18].AsBool(false), env);
 }
 
 const AVS_Linkage* AVS_linkage;
@@ -273,6 +1351,9 @@ extern "C" __declspec(dllexport) const char* __stdcall AvisynthPluginInit3(IScri
 {
     AVS_linkage = vectors;
 
-    env->AddFunction("FFTSpectrum", "c[grid]b[opt]i", Create_FFTSpectrum, 0);
+    env->AddFunction("FFTSpectrum",
+        "c[grid]b[opt]i[wisdom]s[threads]i[planner]i[plan_timelimit]f[engine]i[inplace]b[prefetch]i[cache]i[dedup]b[async_plan]b"
+        "[planes]i*[left]i[top]i[width]i[height]i[fields]b",
+        Create_FFTSpectrum, 0);
     return "FFTSpectrum";
 }
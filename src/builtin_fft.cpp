@@ -0,0 +1,86 @@
+#include <cmath>
+#include <numbers>
+
+#include "builtin_fft.h"
+
+builtin_fft_1d::builtin_fft_1d(int length) : length(length)
+{
+    std::vector<int> radices;
+    int remaining = length;
+
+    for (const int radix : {4, 2, 3, 5})
+    {
+        while (remaining % radix == 0)
+        {
+            radices.emplace_back(radix);
+            remaining /= radix;
+        }
+    }
+
+    for (int radix = 7; remaining > 1; radix += 2)
+    {
+        while (remaining % radix == 0)
+        {
+            radices.emplace_back(radix);
+            remaining /= radix;
+        }
+    }
+
+    int n = length;
+    int stride = 1;
+
+    for (const int radix : radices)
+    {
+        builtin_fft_stage& stage = stages.emplace_back();
+        stage.radix = radix;
+        stage.n = n;
+        stage.stride = stride;
+
+        const int m = n / radix;
+        stage.twiddle_re.resize(static_cast<size_t>(m) * (radix - 1));
+        stage.twiddle_im.resize(static_cast<size_t>(m) * (radix - 1));
+
+        for (int p = 0; p < m; ++p)
+        {
+            for (int k = 1; k < radix; ++k)
+            {
+                const double angle = -2.0 * std::numbers::pi * static_cast<double>((static_cast<int64_t>(p) * k) % n) / n;
+                stage.twiddle_re[static_cast<size_t>(p) * (radix - 1) + k - 1] = static_cast<float>(std::cos(angle));
+                stage.twiddle_im[static_cast<size_t>(p) * (radix - 1) + k - 1] = static_cast<float>(std::sin(angle));
+            }
+        }
+
+        if (radix > 5)
+        {
+            stage.root_re.resize(radix);
+            stage.root_im.resize(radix);
+
+            for (int k = 0; k < radix; ++k)
+            {
+                const double angle = -2.0 * std::numbers::pi * k / radix;
+                stage.root_re[k] = static_cast<float>(std::cos(angle));
+                stage.root_im[k] = static_cast<float>(std::sin(angle));
+            }
+        }
+
+        n = m;
+        stride *= radix;
+    }
+}
+
+builtin_fft_plan::builtin_fft_plan(int height, int width)
+    : height(height),
+      width(width),
+      padded_height((height + max_lanes - 1) / max_lanes * max_lanes),
+      columns(height),
+      rows(width)
+{
+}
+
+size_t builtin_fft_plan::work_size() const noexcept
+{
+    const size_t max_length = (height > width) ? height : width;
+
+    // Transposed intermediate array (re, im), two ping-pong buffers (re, im) and one vector (re, im) for the output.
+    return 2 * static_cast<size_t>(width) * padded_height + 4 * max_length * max_lanes + 2 * max_lanes;
+}
@@ -0,0 +1,382 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include <avs/config.h>
+
+#include "complex_type.h"
+
+// Built-in mixed-radix (4, 2, 3, 5 and a generic odd radix for the remaining factors) Stockham FFT.
+// It's used when FFTW isn't available. The output has the same layout as fftwf_plan_dft_r2c_2d.
+
+struct builtin_fft_stage
+{
+    int radix;
+    // Length of the sub-transforms processed by the stage.
+    int n;
+    // Number of the interleaved sub-transforms (the product of the previous radices).
+    int stride;
+    // Twiddle factors exp(-2*pi*i*p*k/n), p = 0..n/radix-1, k = 1..radix-1.
+    std::vector<float> twiddle_re;
+    std::vector<float> twiddle_im;
+    // Roots of unity exp(-2*pi*i*k/radix), only for the generic radix.
+    std::vector<float> root_re;
+    std::vector<float> root_im;
+};
+
+class builtin_fft_1d
+{
+public:
+    explicit builtin_fft_1d(int length);
+
+    int length;
+    std::vector<builtin_fft_stage> stages;
+};
+
+class builtin_fft_plan
+{
+public:
+    // Maximum number of float lanes of the used vectors (AVX-512).
+    static constexpr int max_lanes = 16;
+
+    builtin_fft_plan(int height, int width);
+
+    // Size (in floats) of the work buffer needed by builtin_fft_r2c_2d_*.
+    size_t work_size() const noexcept;
+
+    int height;
+    int width;
+    // Height padded to max_lanes - the column of the transposed intermediate array.
+    int padded_height;
+    builtin_fft_1d columns;
+    builtin_fft_1d rows;
+};
+
+template<typename float_vector_type>
+struct builtin_fft_vector;
+
+template<>
+struct builtin_fft_vector<float>
+{
+    static constexpr int size = 1;
+
+    AVS_FORCEINLINE static float load(const float* p) noexcept
+    {
+        return *p;
+    }
+
+    AVS_FORCEINLINE static float load_partial(int, const float* p) noexcept
+    {
+        return *p;
+    }
+
+    AVS_FORCEINLINE static void store(float* p, float v) noexcept
+    {
+        *p = v;
+    }
+};
+
+namespace builtin_fft
+{
+    template<typename float_vector_type>
+    struct complex_vector
+    {
+        float_vector_type re;
+        float_vector_type im;
+    };
+
+    template<typename V>
+    AVS_FORCEINLINE static complex_vector<V> operator+(const complex_vector<V>& a, const complex_vector<V>& b) noexcept
+    {
+        return {a.re + b.re, a.im + b.im};
+    }
+
+    template<typename V>
+    AVS_FORCEINLINE static complex_vector<V> operator-(const complex_vector<V>& a, const complex_vector<V>& b) noexcept
+    {
+        return {a.re - b.re, a.im - b.im};
+    }
+
+    template<typename V>
+    AVS_FORCEINLINE static complex_vector<V> scale(const complex_vector<V>& a, float c) noexcept
+    {
+        return {a.re * V(c), a.im * V(c)};
+    }
+
+    // a * -i
+    template<typename V>
+    AVS_FORCEINLINE static complex_vector<V> mul_neg_i(const complex_vector<V>& a) noexcept
+    {
+        return {a.im, -a.re};
+    }
+
+    template<typename V>
+    AVS_FORCEINLINE static complex_vector<V> mul_twiddle(const complex_vector<V>& a, float w_re, float w_im) noexcept
+    {
+        const V wr(w_re);
+        const V wi(w_im);
+
+        return {a.re * wr - a.im * wi, a.re * wi + a.im * wr};
+    }
+
+    template<typename V>
+    AVS_FORCEINLINE static complex_vector<V> load_element(const float* re, const float* im, int idx) noexcept
+    {
+        using traits = builtin_fft_vector<V>;
+
+        return {
+            traits::load(re + static_cast<ptrdiff_t>(idx) * traits::size), traits::load(im + static_cast<ptrdiff_t>(idx) * traits::size)};
+    }
+
+    template<typename V>
+    AVS_FORCEINLINE static void store_element(float* re, float* im, int idx, const complex_vector<V>& v) noexcept
+    {
+        using traits = builtin_fft_vector<V>;
+
+        traits::store(re + static_cast<ptrdiff_t>(idx) * traits::size, v.re);
+        traits::store(im + static_cast<ptrdiff_t>(idx) * traits::size, v.im);
+    }
+
+    // One decimation-in-frequency Stockham stage.
+    // Each element is a vector of independent transforms (one per lane), stored contiguously.
+    template<typename V, int radix>
+    AVS_FORCEINLINE static void stage_fixed(const builtin_fft_stage& stage, const float* __restrict x_re, const float* __restrict x_im,
+        float* __restrict y_re, float* __restrict y_im) noexcept
+    {
+        constexpr float sin_pi_3 = 0.866025403784438647f;
+        constexpr float cos_2pi_5 = 0.309016994374947424f;
+        constexpr float cos_4pi_5 = -0.809016994374947424f;
+        constexpr float sin_2pi_5 = 0.951056516295153572f;
+        constexpr float sin_4pi_5 = 0.587785252292473129f;
+
+        const int s = stage.stride;
+        const int m = stage.n / radix;
+
+        for (int p = 0; p < m; ++p)
+        {
+            const float* w_re = stage.twiddle_re.data() + p * (radix - 1);
+            const float* w_im = stage.twiddle_im.data() + p * (radix - 1);
+
+            for (int q = 0; q < s; ++q)
+            {
+                complex_vector<V> a[radix];
+                for (int j = 0; j < radix; ++j)
+                    a[j] = load_element<V>(x_re, x_im, q + s * (p + j * m));
+
+                complex_vector<V> b[radix];
+
+                if constexpr (radix == 2)
+                {
+                    b[0] = a[0] + a[1];
+                    b[1] = a[0] - a[1];
+                }
+                else if constexpr (radix == 3)
+                {
+                    const complex_vector<V> t1 = a[1] + a[2];
+                    const complex_vector<V> t2 = scale(mul_neg_i(a[1] - a[2]), sin_pi_3);
+                    const complex_vector<V> m1 = a[0] - scale(t1, 0.5f);
+
+                    b[0] = a[0] + t1;
+                    b[1] = m1 + t2;
+                    b[2] = m1 - t2;
+                }
+                else if constexpr (radix == 4)
+                {
+                    const complex_vector<V> t0 = a[0] + a[2];
+                    const complex_vector<V> t1 = a[0] - a[2];
+                    const complex_vector<V> t2 = a[1] + a[3];
+                    const complex_vector<V> t3 = mul_neg_i(a[1] - a[3]);
+
+                    b[0] = t0 + t2;
+                    b[1] = t1 + t3;
+                    b[2] = t0 - t2;
+                    b[3] = t1 - t3;
+                }
+                else if constexpr (radix == 5)
+                {
+                    const complex_vector<V> t1 = a[1] + a[4];
+                    const complex_vector<V> t2 = a[2] + a[3];
+                    const complex_vector<V> t3 = a[1] - a[4];
+                    const complex_vector<V> t4 = a[2] - a[3];
+
+                    const complex_vector<V> m1 = a[0] + scale(t1, cos_2pi_5) + scale(t2, cos_4pi_5);
+                    const complex_vector<V> m2 = a[0] + scale(t1, cos_4pi_5) + scale(t2, cos_2pi_5);
+                    const complex_vector<V> n1 = mul_neg_i(scale(t3, sin_2pi_5) + scale(t4, sin_4pi_5));
+                    const complex_vector<V> n2 = mul_neg_i(scale(t3, sin_4pi_5) - scale(t4, sin_2pi_5));
+
+                    b[0] = a[0] + t1 + t2;
+                    b[1] = m1 + n1;
+                    b[2] = m2 + n2;
+                    b[3] = m2 - n2;
+                    b[4] = m1 - n1;
+                }
+
+                store_element<V>(y_re, y_im, q + s * radix * p, b[0]);
+
+                for (int k = 1; k < radix; ++k)
+                    store_element<V>(y_re, y_im, q + s * (radix * p + k), (p == 0) ? b[k] : mul_twiddle(b[k], w_re[k - 1], w_im[k - 1]));
+            }
+        }
+    }
+
+    // Naive DFT butterfly for the radices without a dedicated implementation.
+    template<typename V>
+    AVS_FORCEINLINE static void stage_generic(const builtin_fft_stage& stage, const float* __restrict x_re, const float* __restrict x_im,
+        float* __restrict y_re, float* __restrict y_im) noexcept
+    {
+        const int radix = stage.radix;
+        const int s = stage.stride;
+        const int m = stage.n / radix;
+
+        for (int p = 0; p < m; ++p)
+        {
+            const float* w_re = stage.twiddle_re.data() + p * (radix - 1);
+            const float* w_im = stage.twiddle_im.data() + p * (radix - 1);
+
+            for (int q = 0; q < s; ++q)
+            {
+                for (int k = 0; k < radix; ++k)
+                {
+                    complex_vector<V> b = load_element<V>(x_re, x_im, q + s * p);
+
+                    for (int j = 1; j < radix; ++j)
+                    {
+                        const int r = (j * k) % radix;
+                        b = b + mul_twiddle(load_element<V>(x_re, x_im, q + s * (p + j * m)), stage.root_re[r], stage.root_im[r]);
+                    }
+
+                    if (k > 0 && p > 0)
+                        b = mul_twiddle(b, w_re[k - 1], w_im[k - 1]);
+
+                    store_element<V>(y_re, y_im, q + s * (radix * p + k), b);
+                }
+            }
+        }
+    }
+
+    // Transforms the vectors in (a_re, a_im). The result is in a or b, the returned value is true for b.
+    template<typename V>
+    AVS_FORCEINLINE static bool transform(
+        const builtin_fft_1d& fft, float* __restrict a_re, float* __restrict a_im, float* __restrict b_re, float* __restrict b_im) noexcept
+    {
+        bool in_b = false;
+
+        for (const builtin_fft_stage& stage : fft.stages)
+        {
+            const float* x_re = in_b ? b_re : a_re;
+            const float* x_im = in_b ? b_im : a_im;
+            float* y_re = in_b ? a_re : b_re;
+            float* y_im = in_b ? a_im : b_im;
+
+            switch (stage.radix)
+            {
+            case 2:
+                stage_fixed<V, 2>(stage, x_re, x_im, y_re, y_im);
+                break;
+            case 3:
+                stage_fixed<V, 3>(stage, x_re, x_im, y_re, y_im);
+                break;
+            case 4:
+                stage_fixed<V, 4>(stage, x_re, x_im, y_re, y_im);
+                break;
+            case 5:
+                stage_fixed<V, 5>(stage, x_re, x_im, y_re, y_im);
+                break;
+            default:
+                stage_generic<V>(stage, x_re, x_im, y_re, y_im);
+                break;
+            }
+
+            in_b = !in_b;
+        }
+
+        return in_b;
+    }
+} // namespace builtin_fft
+
+// 2-D real-to-complex transform: srcp is height x width (rows are src_stride floats apart), dstp is height x (width / 2 + 1).
+// srcp is read completely before dstp is written, so the transform can be in-place (src_stride = 2 * (width / 2 + 1)).
+// The columns are transformed first (the lanes of a vector are adjacent columns), the result is transposed and then the rows are
+// transformed the same way (the lanes are adjacent rows).
+template<typename float_vector_type>
+AVS_FORCEINLINE static void builtin_fft_r2c_2d_templated(
+    const builtin_fft_plan& plan, const float* srcp, int src_stride, complex_float* dstp, float* __restrict work) noexcept
+{
+    using traits = builtin_fft_vector<float_vector_type>;
+    constexpr int lanes = traits::size;
+
+    const int height = plan.height;
+    const int width = plan.width;
+    const int padded_height = plan.padded_height;
+    const int spectrum_width = width / 2 + 1;
+    const int max_length = (height > width) ? height : width;
+
+    float* transposed_re = work;
+    float* transposed_im = transposed_re + static_cast<ptrdiff_t>(width) * padded_height;
+    float* a_re = transposed_im + static_cast<ptrdiff_t>(width) * padded_height;
+    float* a_im = a_re + static_cast<ptrdiff_t>(max_length) * builtin_fft_plan::max_lanes;
+    float* b_re = a_im + static_cast<ptrdiff_t>(max_length) * builtin_fft_plan::max_lanes;
+    float* b_im = b_re + static_cast<ptrdiff_t>(max_length) * builtin_fft_plan::max_lanes;
+    float* lane_re = b_im + static_cast<ptrdiff_t>(max_length) * builtin_fft_plan::max_lanes;
+    float* lane_im = lane_re + builtin_fft_plan::max_lanes;
+
+    const float_vector_type zero(0.0f);
+
+    for (int x0 = 0; x0 < width; x0 += lanes)
+    {
+        const int active_lanes = (width - x0 < lanes) ? (width - x0) : lanes;
+
+        for (int y = 0; y < height; ++y)
+        {
+            const float* p = srcp + static_cast<ptrdiff_t>(y) * src_stride + x0;
+            traits::store(a_re + static_cast<ptrdiff_t>(y) * lanes,
+                (active_lanes == lanes) ? traits::load(p) : traits::load_partial(active_lanes, p));
+            traits::store(a_im + static_cast<ptrdiff_t>(y) * lanes, zero);
+        }
+
+        const bool in_b = builtin_fft::transform<float_vector_type>(plan.columns, a_re, a_im, b_re, b_im);
+        const float* res_re = in_b ? b_re : a_re;
+        const float* res_im = in_b ? b_im : a_im;
+
+        for (int v = 0; v < height; ++v)
+        {
+            for (int l = 0; l < active_lanes; ++l)
+            {
+                transposed_re[static_cast<ptrdiff_t>(x0 + l) * padded_height + v] = res_re[static_cast<ptrdiff_t>(v) * lanes + l];
+                transposed_im[static_cast<ptrdiff_t>(x0 + l) * padded_height + v] = res_im[static_cast<ptrdiff_t>(v) * lanes + l];
+            }
+        }
+    }
+
+    for (int v0 = 0; v0 < height; v0 += lanes)
+    {
+        const int active_lanes = (height - v0 < lanes) ? (height - v0) : lanes;
+
+        // The padding of the transposed rows makes the full loads safe, the extra lanes are ignored.
+        for (int x = 0; x < width; ++x)
+        {
+            traits::store(
+                a_re + static_cast<ptrdiff_t>(x) * lanes, traits::load(transposed_re + static_cast<ptrdiff_t>(x) * padded_height + v0));
+            traits::store(
+                a_im + static_cast<ptrdiff_t>(x) * lanes, traits::load(transposed_im + static_cast<ptrdiff_t>(x) * padded_height + v0));
+        }
+
+        const bool in_b = builtin_fft::transform<float_vector_type>(plan.rows, a_re, a_im, b_re, b_im);
+        const float* res_re = in_b ? b_re : a_re;
+        const float* res_im = in_b ? b_im : a_im;
+
+        for (int u = 0; u < spectrum_width; ++u)
+        {
+            traits::store(lane_re, traits::load(res_re + static_cast<ptrdiff_t>(u) * lanes));
+            traits::store(lane_im, traits::load(res_im + static_cast<ptrdiff_t>(u) * lanes));
+
+            for (int l = 0; l < active_lanes; ++l)
+            {
+                complex_float& out = dstp[static_cast<ptrdiff_t>(v0 + l) * spectrum_width + u];
+                out.re = lane_re[l];
+                out.im = lane_im[l];
+            }
+        }
+    }
+}
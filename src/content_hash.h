@@ -0,0 +1,76 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <type_traits>
+
+#include "sample_type.h"
+
+// Hash of the source samples that is used to detect duplicated frames.
+// The SIMD code mixes the samples per 32-bit lane (MurmurHash3 block mixing) and folds the lanes into 64 bits, the C code mixes them into
+// one 64-bit state (MurmurHash64A). The value depends on the code path (C/SIMD width), so hashes are comparable only within one filter
+// instance.
+namespace content_hash
+{
+    constexpr uint32_t c1 = 0xcc9e2d51u;
+    constexpr uint32_t c2 = 0x1b873593u;
+    constexpr uint32_t c3 = 0xe6546b64u;
+
+    constexpr uint32_t rotl(uint32_t x, int r) noexcept
+    {
+        return (x << r) | (x >> (32 - r));
+    }
+
+    constexpr uint32_t mix(uint32_t h, uint32_t k) noexcept
+    {
+        k *= c1;
+        k = rotl(k, 15);
+        k *= c2;
+
+        return rotl(h ^ k, 13) * 5 + c3;
+    }
+
+    // MurmurHash64A step.
+    constexpr uint64_t mix64(uint64_t h, uint64_t k) noexcept
+    {
+        constexpr uint64_t m = 0xc6a4a7935bd1e995ull;
+
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+
+        return (h ^ k) * m;
+    }
+
+    // The integer samples are hashed as they are, the float samples as their bit patterns, YUY2 - the luma.
+    template<typename T>
+    constexpr uint32_t sample_bits(T sample) noexcept
+    {
+        if constexpr (std::is_same_v<T, float>)
+            return std::bit_cast<uint32_t>(sample);
+        else if constexpr (std::is_same_v<T, yuy2_luma>)
+            return sample.y;
+        else
+            return sample;
+    }
+
+    // FNV-1a step over a 32-bit lane.
+    constexpr uint64_t fold(uint64_t h, uint32_t lane) noexcept
+    {
+        return (h ^ lane) * 0x100000001b3ull;
+    }
+
+    // MurmurHash3 fmix64.
+    constexpr uint64_t finalize(uint64_t h) noexcept
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+
+        return h;
+    }
+
+    constexpr uint64_t seed = 0xcbf29ce484222325ull;
+} // namespace content_hash
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+
+// A pixel of packed YUY2 (Y0 U Y1 V): the luma sample and a chroma sample. Only the luma is read.
+struct yuy2_luma
+{
+    uint8_t y;
+    uint8_t chroma;
+};
+
+// The (not scaled) value of a source sample.
+template<typename T>
+constexpr float sample_value(T sample) noexcept
+{
+    if constexpr (std::is_same_v<T, yuy2_luma>)
+        return sample.y;
+    else
+        return static_cast<float>(sample);
+}
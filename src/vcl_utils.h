@@ -1,124 +1,381 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
 #include <type_traits>
 
 #include "../VCL2/vectorclass.h"
+#include "builtin_fft.h"
 #include "complex_type.h"
+#include "content_hash.h"
 #include <avs/config.h>
 
+template<>
+struct builtin_fft_vector<Vec4f>
+{
+    static constexpr int size = 4;
+
+    AVS_FORCEINLINE static Vec4f load(const float* p) noexcept
+    {
+        return Vec4f().load(p);
+    }
+
+    AVS_FORCEINLINE static Vec4f load_partial(int n, const float* p) noexcept
+    {
+        return Vec4f().load_partial(n, p);
+    }
+
+    AVS_FORCEINLINE static void store(float* p, const Vec4f& v) noexcept
+    {
+        v.store(p);
+    }
+};
+
+#if INSTRSET >= 8
+template<>
+struct builtin_fft_vector<Vec8f>
+{
+    static constexpr int size = 8;
+
+    AVS_FORCEINLINE static Vec8f load(const float* p) noexcept
+    {
+        return Vec8f().load(p);
+    }
+
+    AVS_FORCEINLINE static Vec8f load_partial(int n, const float* p) noexcept
+    {
+        return Vec8f().load_partial(n, p);
+    }
+
+    AVS_FORCEINLINE static void store(float* p, const Vec8f& v) noexcept
+    {
+        v.store(p);
+    }
+};
+#endif
+
+#if INSTRSET >= 10
+template<>
+struct builtin_fft_vector<Vec16f>
+{
+    static constexpr int size = 16;
+
+    AVS_FORCEINLINE static Vec16f load(const float* p) noexcept
+    {
+        return Vec16f().load(p);
+    }
+
+    AVS_FORCEINLINE static Vec16f load_partial(int n, const float* p) noexcept
+    {
+        return Vec16f().load_partial(n, p);
+    }
+
+    AVS_FORCEINLINE static void store(float* p, const Vec16f& v) noexcept
+    {
+        v.store(p);
+    }
+};
+#endif
+
 namespace vcl_utils
 {
     template<typename float_vector_type>
-    AVS_FORCEINLINE static float_vector_type load_n_uint8_to_float(const uint8_t* p)
+    using int_vector_for = decltype(roundi(float_vector_type()));
+
+    template<typename float_vector_type>
+    AVS_FORCEINLINE static int_vector_for<float_vector_type> load_n_uint8_to_int(const uint8_t* p)
     {
         if constexpr (std::is_same_v<float_vector_type, Vec4f>)
-            return to_float(Vec4i().load_4uc(p));
+            return Vec4i().load_4uc(p);
 #if INSTRSET >= 8
         else if constexpr (std::is_same_v<float_vector_type, Vec8f>)
-            return to_float(Vec8i().load_8uc(p));
+            return Vec8i().load_8uc(p);
 #endif
 #if INSTRSET >= 10
         else if constexpr (std::is_same_v<float_vector_type, Vec16f>)
-            return to_float(Vec16i().load_16uc(p));
+            return Vec16i().load_16uc(p);
 #endif
     }
 
-    template<typename float_vector_type, typename complex_float>
-    AVS_FORCEINLINE void fill_fft_input_array_templated(
-        complex_float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height, int stride) noexcept
+    template<typename float_vector_type>
+    AVS_FORCEINLINE static int_vector_for<float_vector_type> load_n_uint16_to_int(const uint16_t* p)
     {
-        constexpr int uint8_per_native_vector_load = float_vector_type::size();
+        if constexpr (std::is_same_v<float_vector_type, Vec4f>)
+            return Vec4i().load_4us(p);
+#if INSTRSET >= 8
+        else if constexpr (std::is_same_v<float_vector_type, Vec8f>)
+            return Vec8i().load_8us(p);
+#endif
+#if INSTRSET >= 10
+        else if constexpr (std::is_same_v<float_vector_type, Vec16f>)
+            return Vec16i().load_16us(p);
+#endif
+    }
+
+    // The integer samples are zero-extended, the float samples are loaded as their bit patterns (hashed as they are).
+    // YUY2: the pixels are loaded as 16-bit words and the chroma (high byte) is masked out.
+    template<typename float_vector_type, typename T>
+    AVS_FORCEINLINE static int_vector_for<float_vector_type> load_n_samples(const T* p)
+    {
+        if constexpr (std::is_same_v<T, uint8_t>)
+            return load_n_uint8_to_int<float_vector_type>(p);
+        else if constexpr (std::is_same_v<T, uint16_t>)
+            return load_n_uint16_to_int<float_vector_type>(p);
+        else if constexpr (std::is_same_v<T, yuy2_luma>)
+            return load_n_uint16_to_int<float_vector_type>(reinterpret_cast<const uint16_t*>(p)) & int_vector_for<float_vector_type>(0xFF);
+        else
+            return reinterpret_i(float_vector_type().load(p));
+    }
+
+    template<typename float_vector_type, typename T>
+    AVS_FORCEINLINE static float_vector_type samples_to_float(const int_vector_for<float_vector_type>& v)
+    {
+        if constexpr (std::is_same_v<T, float>)
+            return reinterpret_f(v);
+        else
+            return to_float(v);
+    }
+
+    // content_hash::mix for every lane.
+    template<typename int_vector_type>
+    AVS_FORCEINLINE static int_vector_type hash_mix(const int_vector_type& h, int_vector_type k)
+    {
+        k *= int_vector_type(static_cast<int>(content_hash::c1));
+        k = rotate_left(k, 15);
+        k *= int_vector_type(static_cast<int>(content_hash::c2));
+
+        return rotate_left(h ^ k, 13) * int_vector_type(5) + int_vector_type(static_cast<int>(content_hash::c3));
+    }
+
+    // The samples of type T (uint8_t, uint16_t, float, yuy2_luma) are multiplied by scale.
+    // centered: the input is multiplied by (-1)^(x+y). Vectors have an even number of lanes, so the sign pattern is the same
+    // for every vector of a row.
+    // Returns the content hash of the source rows if hashed, otherwise 0.
+    template<typename float_vector_type, typename T, bool hashed>
+    AVS_FORCEINLINE uint64_t fill_fft_input_array_impl(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height,
+        int stride, int dst_stride, float scale, bool centered) noexcept
+    {
+        using int_vector_type = int_vector_for<float_vector_type>;
+
+        constexpr int samples_per_native_vector_load = float_vector_type::size();
         constexpr int ops_in_unrolled_loop = 4;
-        constexpr int uint8_in_unrolled_loop = ops_in_unrolled_loop * uint8_per_native_vector_load;
+        constexpr int samples_in_unrolled_loop = ops_in_unrolled_loop * samples_per_native_vector_load;
 
-        const int mod_width_unrolled = width - (width % uint8_in_unrolled_loop);
+        const int mod_width_unrolled = width - (width % samples_in_unrolled_loop);
+
+        float sign_pattern[samples_per_native_vector_load];
+        for (int i = 0; i < samples_per_native_vector_load; ++i)
+            sign_pattern[i] = (centered && (i & 1)) ? -scale : scale;
+
+        const float_vector_type sign_even_row = float_vector_type().load(sign_pattern);
+        const float_vector_type sign_odd_row = centered ? -sign_even_row : sign_even_row;
+
+        // One chain per unrolled load.
+        int_vector_type hash_lanes[ops_in_unrolled_loop] = {int_vector_type(0), int_vector_type(1), int_vector_type(2), int_vector_type(3)};
+        uint32_t tail_hash = 0;
 
         for (int y = 0; y < height; ++y)
         {
-            const uint8_t* p_src = srcp + static_cast<ptrdiff_t>(y) * stride;
-            complex_float* p_dst_base = dstp + static_cast<ptrdiff_t>(y) * width;
+            const T* p_src = reinterpret_cast<const T*>(srcp + static_cast<ptrdiff_t>(y) * stride);
+            // Rows of the real input are dst_stride floats apart, so they are not necessarily vector aligned.
+            float* p_dst = dstp + static_cast<ptrdiff_t>(y) * dst_stride;
+            const float_vector_type sign = (y & 1) ? sign_odd_row : sign_even_row;
+            const float tail_sign = (centered && (y & 1)) ? -scale : scale;
 
-            for (int x = 0; x < mod_width_unrolled; x += uint8_in_unrolled_loop)
+            for (int x = 0; x < mod_width_unrolled; x += samples_in_unrolled_loop)
             {
-                float_vector_type src_parts[ops_in_unrolled_loop] = {vcl_utils::load_n_uint8_to_float<float_vector_type>(p_src + x),
-                    vcl_utils::load_n_uint8_to_float<float_vector_type>(p_src + x + uint8_per_native_vector_load),
-                    vcl_utils::load_n_uint8_to_float<float_vector_type>(p_src + x + 2 * uint8_per_native_vector_load),
-                    vcl_utils::load_n_uint8_to_float<float_vector_type>(p_src + x + 3 * uint8_per_native_vector_load)};
+                const int_vector_type src_samples[ops_in_unrolled_loop] = {
+                    vcl_utils::load_n_samples<float_vector_type>(p_src + x),
+                    vcl_utils::load_n_samples<float_vector_type>(p_src + x + samples_per_native_vector_load),
+                    vcl_utils::load_n_samples<float_vector_type>(p_src + x + 2 * samples_per_native_vector_load),
+                    vcl_utils::load_n_samples<float_vector_type>(p_src + x + 3 * samples_per_native_vector_load)};
 
-                const int complex_offset_in_dst[ops_in_unrolled_loop] = {
-                    x, x + uint8_per_native_vector_load, x + 2 * uint8_per_native_vector_load, x + 3 * uint8_per_native_vector_load};
-
-                if constexpr (std::is_same_v<float_vector_type, Vec4f>)
+                if constexpr (hashed)
                 {
-                    Vec4f out[8] = {permute4<0, -1, 1, -1>(src_parts[0]), permute4<2, -1, 3, -1>(src_parts[0]),
-                        permute4<0, -1, 1, -1>(src_parts[1]), permute4<2, -1, 3, -1>(src_parts[1]), permute4<0, -1, 1, -1>(src_parts[2]),
-                        permute4<2, -1, 3, -1>(src_parts[2]), permute4<0, -1, 1, -1>(src_parts[3]), permute4<2, -1, 3, -1>(src_parts[3])};
+                    for (int i = 0; i < ops_in_unrolled_loop; ++i)
+                        hash_lanes[i] = hash_mix(hash_lanes[i], src_samples[i]);
+                }
 
-                    out[0].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[0]));
-                    out[1].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[0] + 2));
+                (samples_to_float<float_vector_type, T>(src_samples[0]) * sign).store(p_dst + x);
+                (samples_to_float<float_vector_type, T>(src_samples[1]) * sign).store(p_dst + x + samples_per_native_vector_load);
+                (samples_to_float<float_vector_type, T>(src_samples[2]) * sign).store(p_dst + x + 2 * samples_per_native_vector_load);
+                (samples_to_float<float_vector_type, T>(src_samples[3]) * sign).store(p_dst + x + 3 * samples_per_native_vector_load);
+            }
 
-                    out[2].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[1]));
-                    out[3].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[1] + 2));
+            for (int x = mod_width_unrolled; x < width; ++x)
+            {
+                if constexpr (hashed)
+                    tail_hash = content_hash::mix(tail_hash, content_hash::sample_bits(p_src[x]));
+
+                p_dst[x] = sample_value(p_src[x]) * ((centered && (x & 1)) ? -tail_sign : tail_sign);
+            }
+        }
 
-                    out[4].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[2]));
-                    out[5].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[2] + 2));
+        if constexpr (hashed)
+        {
+            uint32_t lanes[ops_in_unrolled_loop * samples_per_native_vector_load];
 
-                    out[6].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[3]));
-                    out[7].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[3] + 2));
-                }
-#if INSTRSET >= 8
-                else if constexpr (std::is_same_v<float_vector_type, Vec8f>)
-                {
-                    Vec8f out[8] = {permute8<0, -1, 1, -1, 2, -1, 3, -1>(src_parts[0]), permute8<4, -1, 5, -1, 6, -1, 7, -1>(src_parts[0]),
-                        permute8<0, -1, 1, -1, 2, -1, 3, -1>(src_parts[1]), permute8<4, -1, 5, -1, 6, -1, 7, -1>(src_parts[1]),
-                        permute8<0, -1, 1, -1, 2, -1, 3, -1>(src_parts[2]), permute8<4, -1, 5, -1, 6, -1, 7, -1>(src_parts[2]),
-                        permute8<0, -1, 1, -1, 2, -1, 3, -1>(src_parts[3]), permute8<4, -1, 5, -1, 6, -1, 7, -1>(src_parts[3])};
+            for (int i = 0; i < ops_in_unrolled_loop; ++i)
+                hash_lanes[i].store(reinterpret_cast<int32_t*>(lanes + i * samples_per_native_vector_load));
 
-                    out[0].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[0]));
-                    out[1].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[0] + 4));
+            uint64_t hash = content_hash::fold(content_hash::seed, tail_hash);
 
-                    out[2].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[1]));
-                    out[3].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[1] + 4));
+            for (const uint32_t lane : lanes)
+                hash = content_hash::fold(hash, lane);
 
-                    out[4].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[2]));
-                    out[5].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[2] + 4));
+            return hash;
+        }
+        else
+        {
+            return 0;
+        }
+    }
 
-                    out[6].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[3]));
-                    out[7].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[3] + 4));
-                }
+    template<typename float_vector_type, typename T>
+    AVS_FORCEINLINE uint64_t fill_fft_input_array_templated(float* __restrict dstp, const uint8_t* __restrict srcp, int width, int height,
+        int stride, int dst_stride, float scale, bool centered, bool hashed) noexcept
+    {
+        if (hashed)
+            return fill_fft_input_array_impl<float_vector_type, T, true>(dstp, srcp, width, height, stride, dst_stride, scale, centered);
+        else
+            return fill_fft_input_array_impl<float_vector_type, T, false>(dstp, srcp, width, height, stride, dst_stride, scale, centered);
+    }
+
+    template<typename float_vector_type>
+    AVS_FORCEINLINE static float_vector_type reverse(const float_vector_type& v)
+    {
+        if constexpr (std::is_same_v<float_vector_type, Vec4f>)
+            return permute4<3, 2, 1, 0>(v);
+#if INSTRSET >= 8
+        else if constexpr (std::is_same_v<float_vector_type, Vec8f>)
+            return permute8<7, 6, 5, 4, 3, 2, 1, 0>(v);
+#endif
+#if INSTRSET >= 10
+        else if constexpr (std::is_same_v<float_vector_type, Vec16f>)
+            return permute16<15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0>(v);
+#endif
+    }
+
+    // Rounds 4 vectors to the nearest integer and stores them as 4 * size() uint8 with unsigned saturation.
+    template<typename float_vector_type>
+    AVS_FORCEINLINE static void store_4_float_as_uint8(uint8_t* p, const float_vector_type* v)
+    {
+        if constexpr (std::is_same_v<float_vector_type, Vec4f>)
+            compress_saturated_s2u(compress_saturated(roundi(v[0]), roundi(v[1])), compress_saturated(roundi(v[2]), roundi(v[3])))
+                .store(p);
+#if INSTRSET >= 8
+        else if constexpr (std::is_same_v<float_vector_type, Vec8f>)
+            compress_saturated_s2u(compress_saturated(roundi(v[0]), roundi(v[1])), compress_saturated(roundi(v[2]), roundi(v[3])))
+                .store(p);
 #endif
 #if INSTRSET >= 10
-                else if constexpr (std::is_same_v<float_vector_type, Vec16f>)
+        else if constexpr (std::is_same_v<float_vector_type, Vec16f>)
+            compress_saturated_s2u(compress_saturated(roundi(v[0]), roundi(v[1])), compress_saturated(roundi(v[2]), roundi(v[3])))
+                .store(p);
+#endif
+    }
+
+    AVS_FORCEINLINE static uint8_t spectrum_value_to_uint8(float val_sq, float threshold_sq, float threshold, float scale)
+    {
+        if (val_sq <= threshold_sq)
+            return 0;
+
+        const float val = logf(sqrtf(val_sq) + 1.0f);
+        const float buf = (val > threshold) ? val * scale : 0.0f;
+        return static_cast<uint8_t>(lrintf((buf > 255.0f) ? 255.0f : buf));
+    }
+
+    // Renders count pixels from consecutive squared magnitudes. reversed: the values are read from srcp downwards.
+    // The logarithm is evaluated only for vectors that have at least one value above threshold_sq.
+    template<typename float_vector_type, bool reversed>
+    AVS_FORCEINLINE static void draw_spectrum_run(
+        uint8_t* __restrict dstp, const float* __restrict srcp, int count, float threshold_sq, float threshold, float scale)
+    {
+        constexpr int floats_per_native_vector_op = float_vector_type::size();
+        constexpr int ops_in_unrolled_loop = 4;
+        constexpr int floats_in_unrolled_loop = ops_in_unrolled_loop * floats_per_native_vector_op;
+
+        const int mod_count_unrolled = count - (count % floats_in_unrolled_loop);
+        const float_vector_type threshold_sq_vec(threshold_sq);
+        const float_vector_type threshold_vec(threshold);
+        const float_vector_type scale_vec(scale);
+        const float_vector_type vcl_zero(0.0f);
+        const float_vector_type vcl_one(1.0f);
+
+        for (int x = 0; x < mod_count_unrolled; x += floats_in_unrolled_loop)
+        {
+            float_vector_type vals[ops_in_unrolled_loop];
+            for (int i = 0; i < ops_in_unrolled_loop; ++i)
+            {
+                const int offset = x + i * floats_per_native_vector_op;
+                const float_vector_type val_sq = (reversed)
+                    ? reverse(float_vector_type().load(srcp - offset - (floats_per_native_vector_op - 1)))
+                    : float_vector_type().load(srcp + offset);
+                const auto candidates = val_sq > threshold_sq_vec;
+
+                if (horizontal_or(candidates))
                 {
-                    Vec16f out[8] = {permute16<0, -1, 1, -1, 2, -1, 3, -1, 4, -1, 5, -1, 6, -1, 7, -1>(src_parts[0]),
-                        permute16<8, -1, 9, -1, 10, -1, 11, -1, 12, -1, 13, -1, 14, -1, 15, -1>(src_parts[0]),
-                        permute16<0, -1, 1, -1, 2, -1, 3, -1, 4, -1, 5, -1, 6, -1, 7, -1>(src_parts[1]),
-                        permute16<8, -1, 9, -1, 10, -1, 11, -1, 12, -1, 13, -1, 14, -1, 15, -1>(src_parts[1]),
-                        permute16<0, -1, 1, -1, 2, -1, 3, -1, 4, -1, 5, -1, 6, -1, 7, -1>(src_parts[2]),
-                        permute16<8, -1, 9, -1, 10, -1, 11, -1, 12, -1, 13, -1, 14, -1, 15, -1>(src_parts[2]),
-                        permute16<0, -1, 1, -1, 2, -1, 3, -1, 4, -1, 5, -1, 6, -1, 7, -1>(src_parts[3]),
-                        permute16<8, -1, 9, -1, 10, -1, 11, -1, 12, -1, 13, -1, 14, -1, 15, -1>(src_parts[3])};
-
-                    out[0].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[0]));
-                    out[1].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[0] + 8));
-
-                    out[2].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[1]));
-                    out[3].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[1] + 8));
-
-                    out[4].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[2]));
-                    out[5].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[2] + 8));
-
-                    out[6].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[3]));
-                    out[7].store_a(reinterpret_cast<float*>(p_dst_base + complex_offset_in_dst[3] + 8));
+                    const float_vector_type val = log_ps_vcl_generic<float_vector_type>(sqrt(val_sq) + vcl_one);
+                    vals[i] = select(candidates & (val > threshold_vec), val * scale_vec, vcl_zero);
+                }
+                else
+                {
+                    vals[i] = vcl_zero;
                 }
-#endif
             }
 
-            for (int x = mod_width_unrolled; x < width; ++x)
+            store_4_float_as_uint8<float_vector_type>(dstp + x, vals);
+        }
+
+        for (int x = mod_count_unrolled; x < count; ++x)
+            dstp[x] = spectrum_value_to_uint8((reversed) ? srcp[-x] : srcp[x], threshold_sq, threshold, scale);
+    }
+
+    // srcp holds the squared magnitudes of the non-redundant half (width / 2 + 1 columns) of the spectrum; see
+    // draw_fft_spectrum_c. Only the rows [y_begin, y_end) of dstp are drawn. Every destination row is split into runs of
+    // consecutive values that are either read forwards from the row itself or backwards from its Hermitian mirror.
+    template<typename float_vector_type>
+    AVS_FORCEINLINE void draw_fft_spectrum_templated(
+        uint8_t* __restrict dstp, const float* __restrict srcp, int width, int height, int stride, float max_sq, bool centered,
+        int y_begin, int y_end) noexcept
+    {
+        const int spectrum_width = width / 2 + 1;
+        const float max_value = log_ps_vcl_generic<float_vector_type>(float_vector_type(sqrtf(max_sq) + 1.0f))[0];
+        const float threshold = max_value / 2;
+        const float scale = (max_value > 0.0f) ? 255.0f / max_value : 0.0f;
+        // log(m + 1) > log(max + 1) / 2 <=> m > sqrt(max + 1) - 1. The bound is lowered slightly so the approximated
+        // logarithm makes the final decision for the values near the threshold.
+        const float threshold_m = sqrtf(sqrtf(max_sq) + 1.0f) - 1.0f;
+        const float threshold_sq = threshold_m * threshold_m * 0.99f;
+        const int shift = centered ? 0 : width - width / 2;
+
+        for (int y = y_begin; y < y_end; ++y)
+        {
+            const int src_y = centered ? y : (y + height - height / 2) % height;
+            const float* src_row = srcp + src_y * spectrum_width;
+            const float* src_row_mirrored = srcp + ((height - src_y) % height) * spectrum_width;
+            uint8_t* dst_row = dstp + static_cast<ptrdiff_t>(y) * stride;
+
+            int x = 0;
+            while (x < width)
             {
-                p_dst_base[x].re = static_cast<float>(p_src[x]);
-                p_dst_base[x].im = 0.0f;
+                const int src_x = (x + shift) % width;
+                int count;
+
+                if (src_x < spectrum_width)
+                {
+                    count = std::min(spectrum_width - src_x, width - x);
+                    draw_spectrum_run<float_vector_type, false>(
+                        dst_row + x, src_row + src_x, count, threshold_sq, threshold, scale);
+                }
+                else
+                {
+                    count = width - std::max(src_x, x);
+                    draw_spectrum_run<float_vector_type, true>(
+                        dst_row + x, src_row_mirrored + (width - src_x), count, threshold_sq, threshold, scale);
+                }
+
+                x += count;
             }
         }
     }
@@ -164,24 +421,29 @@ namespace vcl_utils
 #endif
     }
 
+    // Writes the squared magnitudes and returns their maximum, the one at excluded_index (the DC component) is not taken
+    // into account. The logarithm is applied when drawing.
     template<typename float_vector_type, bool intermediate_vectors>
-    AVS_FORCEINLINE void calculate_absolute_values_templated(
-        float* __restrict dstp, const complex_float* __restrict src, int length) noexcept
+    AVS_FORCEINLINE float calculate_absolute_values_templated(
+        float* __restrict dstp, const complex_float* __restrict src, int length, int excluded_index) noexcept
     {
         constexpr int complex_per_native_vector_op = float_vector_type::size();
         constexpr int ops_in_unrolled_loop = 4;
         constexpr int complex_in_unrolled_loop = ops_in_unrolled_loop * complex_per_native_vector_op;
 
         const int mod_length_unrolled = length - (length % complex_in_unrolled_loop);
-        const float_vector_type vcl_one(1.0f);
 
         const float* srcp_float = reinterpret_cast<const float*>(src);
 
+        float_vector_type max_vec(0.0f);
+        float max_value = 0.0f;
+
         for (int i = 0; i < mod_length_unrolled; i += complex_in_unrolled_loop)
         {
+            float_vector_type abs_val_sq_arr[ops_in_unrolled_loop];
+
             if constexpr (intermediate_vectors)
             {
-
                 float_vector_type real_parts_arr[ops_in_unrolled_loop];
                 float_vector_type imag_parts_arr[ops_in_unrolled_loop];
 
@@ -193,65 +455,41 @@ namespace vcl_utils
                 load_deinterleaved<float_vector_type>(
                     real_parts_arr[3], imag_parts_arr[3], srcp_float + (i + 3 * complex_per_native_vector_op) * 2);
 
-                float_vector_type abs_val_sq_arr[ops_in_unrolled_loop] = {
-                    mul_add(real_parts_arr[0], real_parts_arr[0], imag_parts_arr[0] * imag_parts_arr[0]),
-                    mul_add(real_parts_arr[1], real_parts_arr[1], imag_parts_arr[1] * imag_parts_arr[1]),
-                    mul_add(real_parts_arr[2], real_parts_arr[2], imag_parts_arr[2] * imag_parts_arr[2]),
-                    mul_add(real_parts_arr[3], real_parts_arr[3], imag_parts_arr[3] * imag_parts_arr[3])};
-
-                float_vector_type log_abs_val_arr[ops_in_unrolled_loop] = {
-                    log_ps_vcl_generic<float_vector_type>(sqrt(abs_val_sq_arr[0]) + vcl_one),
-                    log_ps_vcl_generic<float_vector_type>(sqrt(abs_val_sq_arr[1]) + vcl_one),
-                    log_ps_vcl_generic<float_vector_type>(sqrt(abs_val_sq_arr[2]) + vcl_one),
-                    log_ps_vcl_generic<float_vector_type>(sqrt(abs_val_sq_arr[3]) + vcl_one)};
-
-                log_abs_val_arr[0].store_a(dstp + i);
-                log_abs_val_arr[1].store_a(dstp + i + complex_per_native_vector_op);
-                log_abs_val_arr[2].store_a(dstp + i + 2 * complex_per_native_vector_op);
-                log_abs_val_arr[3].store_a(dstp + i + 3 * complex_per_native_vector_op);
-            }
-            else
-            {
-                float_vector_type real_parts_arr[ops_in_unrolled_loop];
-                float_vector_type imag_parts_arr[ops_in_unrolled_loop];
-                float_vector_type abs_val_sq_arr[ops_in_unrolled_loop];
-                float_vector_type abs_val_arr[ops_in_unrolled_loop];
-                float_vector_type log_abs_val_arr[ops_in_unrolled_loop];
-
-                const float* current_src_float0 = srcp_float + i * 2;
-                load_deinterleaved<float_vector_type>(real_parts_arr[0], imag_parts_arr[0], current_src_float0);
                 abs_val_sq_arr[0] = mul_add(real_parts_arr[0], real_parts_arr[0], imag_parts_arr[0] * imag_parts_arr[0]);
-                abs_val_arr[0] = sqrt(abs_val_sq_arr[0]);
-                abs_val_arr[0] = abs_val_arr[0] + vcl_one;
-                log_abs_val_arr[0] = log_ps_vcl_generic<float_vector_type>(abs_val_arr[0]);
-                log_abs_val_arr[0].store_a(dstp + i);
-
-                const int complex_start_idx1 = i + complex_per_native_vector_op;
-                const float* current_src_float1 = srcp_float + complex_start_idx1 * 2;
-                load_deinterleaved<float_vector_type>(real_parts_arr[1], imag_parts_arr[1], current_src_float1);
                 abs_val_sq_arr[1] = mul_add(real_parts_arr[1], real_parts_arr[1], imag_parts_arr[1] * imag_parts_arr[1]);
-                abs_val_arr[1] = sqrt(abs_val_sq_arr[1]);
-                abs_val_arr[1] = abs_val_arr[1] + vcl_one;
-                log_abs_val_arr[1] = log_ps_vcl_generic<float_vector_type>(abs_val_arr[1]);
-                log_abs_val_arr[1].store_a(dstp + complex_start_idx1);
-
-                const int complex_start_idx2 = i + 2 * complex_per_native_vector_op;
-                const float* current_src_float2 = srcp_float + complex_start_idx2 * 2;
-                load_deinterleaved<float_vector_type>(real_parts_arr[2], imag_parts_arr[2], current_src_float2);
                 abs_val_sq_arr[2] = mul_add(real_parts_arr[2], real_parts_arr[2], imag_parts_arr[2] * imag_parts_arr[2]);
-                abs_val_arr[2] = sqrt(abs_val_sq_arr[2]);
-                abs_val_arr[2] = abs_val_arr[2] + vcl_one;
-                log_abs_val_arr[2] = log_ps_vcl_generic<float_vector_type>(abs_val_arr[2]);
-                log_abs_val_arr[2].store_a(dstp + complex_start_idx2);
-
-                const int complex_start_idx3 = i + 3 * complex_per_native_vector_op;
-                const float* current_src_float3 = srcp_float + complex_start_idx3 * 2;
-                load_deinterleaved<float_vector_type>(real_parts_arr[3], imag_parts_arr[3], current_src_float3);
                 abs_val_sq_arr[3] = mul_add(real_parts_arr[3], real_parts_arr[3], imag_parts_arr[3] * imag_parts_arr[3]);
-                abs_val_arr[3] = sqrt(abs_val_sq_arr[3]);
-                abs_val_arr[3] = abs_val_arr[3] + vcl_one;
-                log_abs_val_arr[3] = log_ps_vcl_generic<float_vector_type>(abs_val_arr[3]);
-                log_abs_val_arr[3].store_a(dstp + complex_start_idx3);
+
+                abs_val_sq_arr[0].store_a(dstp + i);
+                abs_val_sq_arr[1].store_a(dstp + i + complex_per_native_vector_op);
+                abs_val_sq_arr[2].store_a(dstp + i + 2 * complex_per_native_vector_op);
+                abs_val_sq_arr[3].store_a(dstp + i + 3 * complex_per_native_vector_op);
+            }
+            else
+            {
+                for (int k = 0; k < ops_in_unrolled_loop; ++k)
+                {
+                    float_vector_type real_parts;
+                    float_vector_type imag_parts;
+
+                    const int complex_start_idx = i + k * complex_per_native_vector_op;
+                    load_deinterleaved<float_vector_type>(real_parts, imag_parts, srcp_float + complex_start_idx * 2);
+                    abs_val_sq_arr[k] = mul_add(real_parts, real_parts, imag_parts * imag_parts);
+                    abs_val_sq_arr[k].store_a(dstp + complex_start_idx);
+                }
+            }
+
+            if (static_cast<unsigned>(excluded_index - i) < static_cast<unsigned>(complex_in_unrolled_loop))
+            {
+                for (int j = i; j < i + complex_in_unrolled_loop; ++j)
+                {
+                    if (j != excluded_index && dstp[j] > max_value)
+                        max_value = dstp[j];
+                }
+            }
+            else
+            {
+                max_vec = max(max_vec, max(max(abs_val_sq_arr[0], abs_val_sq_arr[1]), max(abs_val_sq_arr[2], abs_val_sq_arr[3])));
             }
         }
 
@@ -259,7 +497,12 @@ namespace vcl_utils
         {
             float re = src[i].re;
             float im = src[i].im;
-            dstp[i] = logf(sqrtf(re * re + im * im) + 1.0f);
+            dstp[i] = re * re + im * im;
+
+            if (i != excluded_index && dstp[i] > max_value)
+                max_value = dstp[i];
         }
+
+        return std::max(max_value, horizontal_max(max_vec));
     }
 } // namespace vcl_utils
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed set of worker threads shared by the filter instances.
+// run() splits a job into tasks that are executed by the workers and by the calling thread, so a job progresses even when all
+// workers are busy with the jobs of other threads.
+class worker_pool
+{
+public:
+    explicit worker_pool(int num_workers)
+    {
+        workers.reserve(num_workers);
+
+        for (int i = 0; i < num_workers; ++i)
+            workers.emplace_back([this]() { worker_loop(); });
+    }
+
+    worker_pool(const worker_pool&) = delete;
+    worker_pool& operator=(const worker_pool&) = delete;
+
+    ~worker_pool()
+    {
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        queue_cv.notify_all();
+
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    // Calls f(i) for every i in [0, count) and returns when all calls are finished. f must not throw.
+    template<typename F>
+    void run(int count, F&& f)
+    {
+        if (count <= 1 || workers.empty())
+        {
+            for (int i = 0; i < count; ++i)
+                f(i);
+
+            return;
+        }
+
+        job j;
+        j.count = count;
+        j.context = &f;
+        j.call = [](void* context, int i) { (*static_cast<std::remove_reference_t<F>*>(context))(i); };
+
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+
+            // The calling thread takes at least one task.
+            for (int i = 1; i < count; ++i)
+                queue.push_back(&j);
+        }
+
+        queue_cv.notify_all();
+
+        execute(j);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        // All tasks are taken - the entries that aren't picked up by a worker yet are useless.
+        queue.erase(std::remove(queue.begin(), queue.end(), &j), queue.end());
+        done_cv.wait(lock, [&j]() { return j.in_flight == 0; });
+    }
+
+private:
+    struct job
+    {
+        int count;
+        void* context;
+        void (*call)(void* context, int i);
+        std::atomic<int> next{0};
+        // Number of workers executing the job, guarded by mutex.
+        int in_flight = 0;
+    };
+
+    static void execute(job& j)
+    {
+        for (int i = j.next.fetch_add(1, std::memory_order_relaxed); i < j.count; i = j.next.fetch_add(1, std::memory_order_relaxed))
+            j.call(j.context, i);
+    }
+
+    void worker_loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true)
+        {
+            queue_cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+
+            if (stopping)
+                return;
+
+            job* j = queue.front();
+            queue.pop_front();
+            ++j->in_flight;
+
+            lock.unlock();
+            execute(*j);
+            lock.lock();
+
+            if (--j->in_flight == 0)
+                done_cv.notify_all();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable queue_cv;
+    std::condition_variable done_cv;
+    std::deque<job*> queue;
+    bool stopping = false;
+};